@@ -2,565 +2,6155 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BPTREE_X86 1
+#endif
 
 // We'll use the definition of ORDER defined here:
 // https://cs186berkeley.net/notes/note4/
+// Each tree picks its own order at runtime (bptree_init_order);
+// ORDER is only the default.
 #ifndef ORDER
 #define ORDER 2  // Default order if not specified during compilation
 #endif
-#define MAX_KEYS (2 * ORDER)  // Maximum number of keys per node
-#define MAX_CHILDREN (2 * ORDER + 1)  // Same as ORDER, maximum number of children
+
+// Keys and values.
+//
+// The key type is picked at compile time, like ORDER:
+//   (default)             int
+//   -DBPTREE_KEY_U64      uint64_t
+//   -DBPTREE_KEY_BYTES16  16-byte binary keys (e.g. UUIDs), ordered like memcmp
+// Each key type brings key_lt/key_eq, key_hash, its own search kernels,
+// and key_from_long/key_print for the examples. Byte keys are kept as two
+// big-endian halves so they compare as a pair of integers.
+//
+// Every key maps to a 64-bit value (a record ID, an offset, ...), which
+// leaves store inline next to the keys.
+#if defined(BPTREE_KEY_U64)
+typedef uint64_t bpkey_t;
+#define KEY_SLOT_MULTIPLE 4  // One AVX2 vector
+#define KEY_TYPE_NAME "u64"
+#elif defined(BPTREE_KEY_BYTES16)
+typedef struct bpkey_t {
+    uint64_t hi;  // Bytes 0-7, big-endian
+    uint64_t lo;  // Bytes 8-15, big-endian
+} bpkey_t;
+#define KEY_SLOT_MULTIPLE 2  // One AVX2 vector
+#define KEY_TYPE_NAME "bytes16"
+#else
+typedef int bpkey_t;
+#define KEY_SLOT_MULTIPLE 4  // One SSE2 vector
+#define KEY_TYPE_NAME "int"
+#endif
+
+typedef uint64_t bpval_t;
+
+#define KEY_ZERO ((bpkey_t){0})
+
+// Mixes every bit of x into every bit of the result (murmur3's
+// finalizer), for hashing keys.
+static inline uint64_t hash64(uint64_t x) {
+    x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+    x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+#if defined(BPTREE_KEY_BYTES16)
+static inline bool key_lt(bpkey_t a, bpkey_t b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+static inline bool key_eq(bpkey_t a, bpkey_t b) {
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+static inline uint64_t key_hash(bpkey_t key) {
+    return hash64(key.hi ^ hash64(key.lo));
+}
+
+// Distance from base up to key (key >= base), for delta-encoded leaves.
+// False if it doesn't fit in 64 bits.
+static inline bool key_delta(bpkey_t base, bpkey_t key, uint64_t* delta) {
+    *delta = key.lo - base.lo;
+    return key.hi == base.hi;
+}
+
+static inline bpkey_t key_add(bpkey_t base, uint64_t delta) {
+    return (bpkey_t){base.hi, base.lo + delta};
+}
+
+static inline uint64_t load_be64(const unsigned char* bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | bytes[i];
+    }
+    return v;
+}
+
+static inline void store_be64(unsigned char* bytes, uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = (unsigned char)v;
+        v >>= 8;
+    }
+}
+
+bpkey_t key_from_bytes(const unsigned char bytes[16]) {
+    return (bpkey_t){load_be64(bytes), load_be64(bytes + 8)};
+}
+
+void key_to_bytes(bpkey_t key, unsigned char bytes[16]) {
+    store_be64(bytes, key.hi);
+    store_be64(bytes + 8, key.lo);
+}
+
+// Numbers go in the last 8 bytes with the sign bit flipped, so byte
+// order matches numeric order.
+static inline bpkey_t key_from_long(long v) {
+    return (bpkey_t){0, (uint64_t)v ^ (1ULL << 63)};
+}
+
+void key_print(bpkey_t key) {
+    if (key.hi == 0) {
+        printf("%ld", (long)(key.lo ^ (1ULL << 63)));
+    } else {
+        printf("%016llx%016llx", (unsigned long long)key.hi, (unsigned long long)key.lo);
+    }
+}
+#else
+static inline bool key_lt(bpkey_t a, bpkey_t b) {
+    return a < b;
+}
+
+static inline bool key_eq(bpkey_t a, bpkey_t b) {
+    return a == b;
+}
+
+static inline uint64_t key_hash(bpkey_t key) {
+    return hash64((uint64_t)key);
+}
+
+// Distance from base up to key (key >= base), for delta-encoded leaves.
+// False if it doesn't fit in 64 bits.
+static inline bool key_delta(bpkey_t base, bpkey_t key, uint64_t* delta) {
+#if defined(BPTREE_KEY_U64)
+    *delta = key - base;
+#else
+    *delta = (uint64_t)((int64_t)key - base);
+#endif
+    return true;
+}
+
+static inline bpkey_t key_add(bpkey_t base, uint64_t delta) {
+    return (bpkey_t)(base + delta);
+}
+
+static inline bpkey_t key_from_long(long v) {
+    return (bpkey_t)v;
+}
+
+void key_print(bpkey_t key) {
+#if defined(BPTREE_KEY_U64)
+    printf("%llu", (unsigned long long)key);
+#else
+    printf("%d", key);
+#endif
+}
+#endif
 
 typedef enum NodeType {
     LEAF,
     INTERNAL
 } NodeType;
 
+// Both node types start with the same header, followed directly by
+// the keys, so the header shares a cache line with the first keys and
+// code that only reads keys doesn't care which type it has.
+//
+// The key array is sized by the tree's order. Each node records its
+// capacity (key_slots, a multiple of KEY_SLOT_MULTIPLE) so it can find
+// what comes after the keys: the values in a leaf, the child pointers
+// in an internal node. Both start at the same offset, so a search only
+// touches the value of the key it found, never the rest of the array.
+//
+// A leaf can also hold its keys packed (format, see LeafFormat below),
+// in which case key_slots is how many entries the packed layout holds.
+//
+// version is the node's optimistic lock for the concurrent API
+// (bptree_search_olc/bptree_insert_olc). The other fields are packed
+// so the header stays 16 bytes.
 typedef struct BPNode {
-    int keys[MAX_KEYS + 1];
-    struct BPNode* children[MAX_CHILDREN + 1];
+    _Atomic uint32_t version;
+    unsigned int nkeys : 14;
+    unsigned int type : 1;        // NodeType
+    unsigned int format : 2;      // LeafFormat, for leaves
+    unsigned int key_slots : 15;  // Capacity of keys[]
     struct BPNode* next;  // For leaf node linking
-    int nkeys;
-    NodeType type;
+    bpkey_t keys[];
 } BPNode;
 
-typedef struct BPTree {
-    BPNode* root;
-} BPTree;
+// A leaf's key model (see leaf_model_fit), which predicts where a key
+// is in the leaf. It sits at the end of the leaf, in the same place
+// whatever the leaf's format, rather than in the header, so the header
+// and keys of the sized kernels' nodes still fill whole cache lines.
+typedef struct LeafModel {
+    float slope;          // Positions per unit of distance from the first key
+    int16_t intercept;
+    uint16_t error;       // Furthest a key may be from its prediction
+} LeafModel;
 
-BPTree bptree;
+#define NODE_HEADER_BYTES (offsetof(BPNode, keys))
+#define MAX_KEY_SLOTS 16380  // Must fit in nkeys
+#define LEAF_MODEL_NONE 0xffff  // error of a leaf without a model
 
-BPNode* node_new(NodeType type) {
-    BPNode* new_node = (BPNode*)malloc(sizeof(BPNode));
-    new_node->type = type;
-    new_node->nkeys = 0;
-    new_node->next = NULL;
-    
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-        new_node->children[i] = NULL;
+static inline size_t node_children_offset(int key_slots) {
+    return NODE_HEADER_BYTES + sizeof(bpkey_t) * (size_t)key_slots;
+}
+
+static inline BPNode** node_children(BPNode* node) {
+    return (BPNode**)((char*)node + node_children_offset(node->key_slots));
+}
+
+// Leaf key formats. Dense keys waste most of every key slot, so a leaf
+// whose keys all lie within 2^16 (or 2^8) of its smallest key can store
+// that key once, in keys[0], followed by 16-bit (or 8-bit) offsets from
+// it (frame of reference). Every leaf of a tree is the same size, so
+// a packed leaf holds more entries: fewer leaves, less memory, and
+// more keys per cache line for the search. Leaves are packed when they
+// are built or split, if the tree has pack_leaves set.
+typedef enum LeafFormat {
+    KEYS_PLAIN,
+    KEYS_FOR16,
+    KEYS_FOR8,
+} LeafFormat;
+
+#define LEAF_FORMATS 3
+
+static inline int format_delta_bytes(int format) {
+    return format == KEYS_FOR8 ? 1 : 2;
+}
+
+static inline uint64_t format_max_delta(int format) {
+    return format == KEYS_FOR8 ? 0xff : 0xffff;
+}
+
+static inline void* leaf_deltas(BPNode* leaf) {
+    return leaf->keys + 1;
+}
+
+static inline size_t leaf_values_offset(int format, int key_slots) {
+    if (format == KEYS_PLAIN) {
+        return node_children_offset(key_slots);
+    }
+    size_t deltas_end = NODE_HEADER_BYTES + sizeof(bpkey_t) +
+                        (size_t)key_slots * format_delta_bytes(format);
+    return (deltas_end + 7) & ~(size_t)7;
+}
+
+static inline bpval_t* node_values(BPNode* node) {
+    return (bpval_t*)((char*)node + leaf_values_offset(node->format, node->key_slots));
+}
+
+static inline size_t leaf_bytes(int key_slots) {
+    return node_children_offset(key_slots) + sizeof(bpval_t) * (size_t)key_slots +
+           sizeof(LeafModel);
+}
+
+static inline size_t internal_bytes(int key_slots, int max_keys) {
+    return node_children_offset(key_slots) + sizeof(BPNode*) * (size_t)(max_keys + 2);
+}
+
+// Insert buffers (see bptree_set_insert_buffers) come after the
+// children of an internal node: a count, then the keys, values and
+// kinds of up to slots messages, oldest first. Internal nodes only have
+// one if their pool's node size leaves room for it.
+#define MESSAGE_INSERT 0
+#define MESSAGE_DELETE 1
+#define BUFFER_HEADER_BYTES 16
+
+static inline size_t node_buffer_offset(int key_slots) {
+    return node_children_offset(key_slots) + sizeof(BPNode*) * (size_t)(key_slots + 1);
+}
+
+static inline size_t buffer_node_bytes(int key_slots, int slots) {
+    return node_buffer_offset(key_slots) + BUFFER_HEADER_BYTES +
+           (sizeof(bpkey_t) + sizeof(bpval_t) + 1) * (size_t)slots;
+}
+
+static inline int* buffer_count(BPNode* node) {
+    return (int*)((char*)node + node_buffer_offset(node->key_slots));
+}
+
+static inline bpkey_t* buffer_keys(BPNode* node) {
+    return (bpkey_t*)((char*)buffer_count(node) + BUFFER_HEADER_BYTES);
+}
+
+static inline bpval_t* buffer_values(BPNode* node, int slots) {
+    return (bpval_t*)(buffer_keys(node) + slots);
+}
+
+static inline uint8_t* buffer_kinds(BPNode* node, int slots) {
+    return (uint8_t*)(buffer_values(node, slots) + slots);
+}
+
+// Largest order whose header and keys fit in the given number of bytes
+// (but at least 1). Leaf values come after that and are only read for
+// the key found.
+int order_for_leaf_bytes(size_t bytes) {
+    int slots = (int)((bytes - NODE_HEADER_BYTES) / sizeof(bpkey_t));
+    slots -= slots % KEY_SLOT_MULTIPLE;
+    int order = (slots - 1) / 2;
+    return order < 1 ? 1 : order;
+}
+
+// Nodes are carved out of large chunks owned by the tree instead of
+// one malloc per node. Each node is rounded up to whole cache lines and
+// starts on a cache line boundary. Leaves and internal nodes have
+// different sizes, so each type has its own pool bumping through its
+// own chunk. Freed nodes go on their pool's free list and are reused
+// first; the whole tree is released by freeing the chunks.
+//
+// With huge_pages set, each chunk is mapped on a 2 MiB boundary and
+// backed by one 2 MiB page, so a random search costs about one dTLB
+// entry per level instead of one per node. MAP_HUGETLB is tried first;
+// without reserved huge pages (vm.nr_hugepages) the chunk is an ordinary
+// aligned mapping advised MADV_HUGEPAGE for transparent huge pages.
+// Internal nodes have their own pool, so the upper levels of the tree
+// are packed into a few such pages whatever order nodes are made in.
+#define CACHE_LINE 64
+#define ARENA_CHUNK_BYTES (2 * 1024 * 1024)
+#define HUGE_PAGE_BYTES (2 * 1024 * 1024)
+#define ROUND_TO_LINE(bytes) (((bytes) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))
+#define ARENA_POOLS 2  // One per NodeType
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t mapped_bytes;  // Huge page chunks are unmapped, others freed (0)
+} ArenaChunk;
+
+typedef struct FreeNode {
+    struct FreeNode* next;
+} FreeNode;
+
+typedef struct ArenaPool {
+    char* cursor;
+    char* end;
+    FreeNode* free_list;
+    size_t node_bytes;
+} ArenaPool;
+
+typedef struct Arena {
+    ArenaChunk* chunks;
+    ArenaPool pools[ARENA_POOLS];
+    size_t bytes;         // Total bytes held in chunks
+    bool huge_pages;      // New chunks are huge page mappings
+    long hugetlb_chunks;  // Of those, the ones MAP_HUGETLB gave
+} Arena;
+
+void arena_init(Arena* arena, size_t leaf_bytes, size_t internal_bytes) {
+    arena->chunks = NULL;
+    arena->bytes = 0;
+    arena->huge_pages = false;
+    arena->hugetlb_chunks = 0;
+    arena->pools[LEAF].node_bytes = ROUND_TO_LINE(leaf_bytes);
+    arena->pools[INTERNAL].node_bytes = ROUND_TO_LINE(internal_bytes);
+    for (int i = 0; i < ARENA_POOLS; i++) {
+        arena->pools[i].cursor = NULL;
+        arena->pools[i].end = NULL;
+        arena->pools[i].free_list = NULL;
+    }
+}
+
+// bytes (a multiple of HUGE_PAGE_BYTES) on a huge page boundary, or
+// NULL if even the fallback mapping fails.
+static void* map_huge_chunk(size_t bytes, bool* hugetlb) {
+    void* memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    *hugetlb = memory != MAP_FAILED;
+    if (*hugetlb) {
+        return memory;
     }
 
-    for (int i = 0; i < MAX_KEYS; i++) {
-        new_node->keys[i] = 0;
+    // Map a huge page more than needed and trim it to the boundary.
+    size_t padded = bytes + HUGE_PAGE_BYTES;
+    char* raw = (char*)mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
     }
-    
-    return new_node;
+    char* aligned = (char*)(((uintptr_t)raw + HUGE_PAGE_BYTES - 1) &
+                            ~(uintptr_t)(HUGE_PAGE_BYTES - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    munmap(aligned + bytes, raw + padded - (aligned + bytes));
+    madvise(aligned, bytes, MADV_HUGEPAGE);
+    return aligned;
 }
 
-void bptree_init(BPTree* bptree) {
-    bptree->root = node_new(LEAF);
+void* arena_alloc(Arena* arena, int pool_index) {
+    ArenaPool* pool = &arena->pools[pool_index];
+    if (pool->free_list != NULL) {
+        FreeNode* node = pool->free_list;
+        pool->free_list = node->next;
+        return node;
+    }
+
+    if (pool->cursor == NULL || pool->cursor + pool->node_bytes > pool->end) {
+        // The chunk header takes the first cache line so nodes stay aligned.
+        size_t chunk_bytes = ARENA_CHUNK_BYTES;
+        if (chunk_bytes < CACHE_LINE + 16 * pool->node_bytes) {
+            chunk_bytes = CACHE_LINE + 16 * pool->node_bytes;
+        }
+        void* memory = NULL;
+        if (arena->huge_pages) {
+            bool hugetlb;
+            chunk_bytes = (chunk_bytes + HUGE_PAGE_BYTES - 1) & ~(size_t)(HUGE_PAGE_BYTES - 1);
+            memory = map_huge_chunk(chunk_bytes, &hugetlb);
+            arena->hugetlb_chunks += hugetlb;
+        } else if (posix_memalign(&memory, CACHE_LINE, chunk_bytes) != 0) {
+            memory = NULL;
+        }
+        if (memory == NULL) {
+            printf("Failed to allocate arena chunk\n");
+            exit(1);
+        }
+        ArenaChunk* chunk = (ArenaChunk*)memory;
+        chunk->next = arena->chunks;
+        chunk->mapped_bytes = arena->huge_pages ? chunk_bytes : 0;
+        arena->chunks = chunk;
+        pool->cursor = (char*)memory + CACHE_LINE;
+        pool->end = (char*)memory + chunk_bytes;
+        arena->bytes += chunk_bytes;
+    }
+
+    void* node = pool->cursor;
+    pool->cursor += pool->node_bytes;
+    return node;
 }
 
-typedef struct Search {
-    BPNode* node;
-    int index;
-} Search;
+void arena_free(Arena* arena, int pool_index, void* node) {
+    ArenaPool* pool = &arena->pools[pool_index];
+    FreeNode* free_node = (FreeNode*)node;
+    free_node->next = pool->free_list;
+    pool->free_list = free_node;
+}
 
-Search bptree_search(BPTree* bptree, int key) {
-    BPNode* node = bptree->root;
-    while (node->type != LEAF) {
-        int i = 0;
-        while (i < node->nkeys && key >= node->keys[i]) {
-            i++;
+// Free every chunk. The pools keep their node sizes and the arena its
+// page size, so it can be used again right away.
+void arena_release(Arena* arena) {
+    ArenaChunk* chunk = arena->chunks;
+    while (chunk != NULL) {
+        ArenaChunk* next = chunk->next;
+        if (chunk->mapped_bytes != 0) {
+            munmap(chunk, chunk->mapped_bytes);
+        } else {
+            free(chunk);
         }
-        node = node->children[i];
+        chunk = next;
     }
+    bool huge_pages = arena->huge_pages;
+    arena_init(arena, arena->pools[LEAF].node_bytes, arena->pools[INTERNAL].node_bytes);
+    arena->huge_pages = huge_pages;
+}
 
-    for (int i = 0; i < node->nkeys; i++) {
-        if (node->keys[i] == key) {
-            return (Search){node, i};
+// Hand all of from's chunks and free nodes over to into, leaving from
+// empty. Whatever is left at the end of from's current chunks goes unused.
+void arena_adopt(Arena* into, Arena* from) {
+    if (from->chunks != NULL) {
+        ArenaChunk* tail = from->chunks;
+        while (tail->next != NULL) {
+            tail = tail->next;
         }
+        tail->next = into->chunks;
+        into->chunks = from->chunks;
     }
-    
-    return (Search){NULL, -1};
+    into->bytes += from->bytes;
+    into->hugetlb_chunks += from->hugetlb_chunks;
+
+    for (int i = 0; i < ARENA_POOLS; i++) {
+        FreeNode* node = from->pools[i].free_list;
+        while (node != NULL) {
+            FreeNode* next = node->next;
+            node->next = into->pools[i].free_list;
+            into->pools[i].free_list = node;
+            node = next;
+        }
+    }
+
+    bool huge_pages = from->huge_pages;
+    arena_init(from, from->pools[LEAF].node_bytes, from->pools[INTERNAL].node_bytes);
+    from->huge_pages = huge_pages;
 }
 
-void node_insert_entry(BPNode* node, int key, BPNode* child) {
+// Index of the child to follow for key: the number of keys <= key.
+// Keys are sorted, so this is also where key would be inserted.
+//
+// This is the inner loop of every descent, so there are vector
+// versions for each key type: 8 int keys (AVX2) or 4 (SSE2) per compare,
+// 4 u64 keys or 2 byte keys per AVX2 compare, counting the matches from
+// a movemask. Each tree picks its kernel once, in bptree_init_order,
+// from its node size and what the CPU supports. Compile with
+// -DBPTREE_NO_SIMD to benchmark the scalar loop.
+typedef int (*UpperBoundFn)(const bpkey_t* keys, int n, bpkey_t key);
+
+static int node_upper_bound_scalar(const bpkey_t* keys, int n, bpkey_t key) {
     int i = 0;
-    while (key >= node->keys[i] && i < node->nkeys) {
+    while (i < n && !key_lt(key, keys[i])) {
         i++;
     }
-    
-    for (int j = node->nkeys; j > i; j--) {
-        node->keys[j] = node->keys[j - 1];
-        node->children[j + 1] = node->children[j];
+    return i;
+}
+
+#if defined(BPTREE_X86) && !defined(BPTREE_NO_SIMD)
+#if defined(BPTREE_KEY_U64)
+// AVX2 only has a signed 64-bit compare; flipping the sign bit of both
+// sides turns it into an unsigned one.
+__attribute__((target("avx2")))
+static int node_upper_bound_avx2(const bpkey_t* keys, int n, bpkey_t key) {
+    __m256i sign = _mm256_set1_epi64x((long long)(1ULL << 63));
+    __m256i needle = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), sign);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i k = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), sign);
+        int gt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, needle)));
+        if (gt != 0) {
+            return i + __builtin_popcount(~gt & 0xf);
+        }
     }
-    
-    node->keys[i] = key;
-    node->children[i + 1] = child;
-    node->nkeys++;
+    return i + node_upper_bound_scalar(keys + i, n - i, key);
+}
+#elif defined(BPTREE_KEY_BYTES16)
+// Two keys per vector, as hi/lo lanes. A key is greater when its hi is
+// greater, or its hi is equal and its lo is greater; the lo lane's bits
+// are shifted onto the hi lane's to combine them.
+__attribute__((target("avx2")))
+static int node_upper_bound_avx2(const bpkey_t* keys, int n, bpkey_t key) {
+    __m256i sign = _mm256_set1_epi64x((long long)(1ULL << 63));
+    __m256i needle = _mm256_set_epi64x((long long)key.lo, (long long)key.hi,
+                                       (long long)key.lo, (long long)key.hi);
+    __m256i needle_signed = _mm256_xor_si256(needle, sign);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m256i k = _mm256_loadu_si256((const __m256i*)(keys + i));
+        int gt = _mm256_movemask_pd(_mm256_castsi256_pd(
+            _mm256_cmpgt_epi64(_mm256_xor_si256(k, sign), needle_signed)));
+        int eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(k, needle)));
+        int key_gt = (gt | (eq & (gt >> 1))) & 0x5;
+        if (key_gt != 0) {
+            return i + ((key_gt & 1) ? 0 : 1);
+        }
+    }
+    return i + node_upper_bound_scalar(keys + i, n - i, key);
+}
+#else
+__attribute__((target("sse2")))
+static int node_upper_bound_sse2(const bpkey_t* keys, int n, bpkey_t key) {
+    __m128i needle = _mm_set1_epi32(key);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i k = _mm_loadu_si128((const __m128i*)(keys + i));
+        int gt = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, needle)));
+        if (gt != 0) {
+            return i + __builtin_popcount(~gt & 0xf);
+        }
+    }
+    return i + node_upper_bound_scalar(keys + i, n - i, key);
 }
 
-typedef struct Split {
-    BPNode* right;
-    int key;
-} Split;
+__attribute__((target("avx2")))
+static int node_upper_bound_avx2(const bpkey_t* keys, int n, bpkey_t key) {
+    __m256i needle = _mm256_set1_epi32(key);
+    int i = 0;
 
-Split node_split(BPNode* node, int key) {
-    BPNode* new_node = node_new(node->type);
+    // Large nodes: test 32 keys per branch, then find the lane.
+    for (; i + 32 <= n; i += 32) {
+        __m256i gt0 = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(keys + i)), needle);
+        __m256i gt1 = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(keys + i + 8)), needle);
+        __m256i gt2 = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(keys + i + 16)), needle);
+        __m256i gt3 = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(keys + i + 24)), needle);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(gt0, gt1), _mm256_or_si256(gt2, gt3));
+        if (!_mm256_testz_si256(any, any)) {
+            break;
+        }
+    }
 
-    Split split;
-    split.right = new_node;
-    split.key = node->keys[node->nkeys / 2];
+    for (; i + 8 <= n; i += 8) {
+        __m256i k = _mm256_loadu_si256((const __m256i*)(keys + i));
+        int gt = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, needle)));
+        if (gt != 0) {
+            return i + __builtin_popcount(~gt & 0xff);
+        }
+    }
+    return i + node_upper_bound_scalar(keys + i, n - i, key);
+}
 
-    // If the node is an internal node, we need to MOVE
-    // the first key to the parent node.
-    int key_copy_start = node->nkeys / 2;
-    if (node->type == INTERNAL) {
-        key_copy_start++;
+// Kernels for node sizes known at compile time. With the slot count
+// fixed, the compare covers the whole key array in straight-line code
+// (no loop, no early exit) and lanes past n are masked off the result.
+// Reads never leave the node, since key_slots are allocated for all.
+// Past 4 cache lines the early-exit loop above wins: a 4 KiB leaf
+// that isn't cached streams in faster than it can be probed.
+__attribute__((target("avx2"), always_inline))
+static inline uint64_t keys_gt_mask_64(const int* keys, int key, const int slots) {
+    __m256i needle = _mm256_set1_epi32(key);
+    uint64_t gt = 0;
+    int c = 0;
+    for (; c + 8 <= slots; c += 8) {
+        __m256i k = _mm256_loadu_si256((const __m256i*)(keys + c));
+        uint64_t bits = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, needle)));
+        gt |= bits << c;
+    }
+    for (; c + 4 <= slots; c += 4) {
+        __m128i k = _mm_loadu_si128((const __m128i*)(keys + c));
+        uint64_t bits = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpgt_epi32(k, _mm256_castsi256_si128(needle))));
+        gt |= bits << c;
     }
+    return gt;
+}
 
-    for (int i = key_copy_start; i < node->nkeys; i++) {
-        new_node->keys[new_node->nkeys++] = node->keys[i];
-        new_node->children[new_node->nkeys - 1] = node->children[i];
-        node->keys[i] = 0;
-        node->children[i] = NULL;
+static inline uint64_t lane_range(int from, int to) {
+    uint64_t upto = to >= 64 ? ~0ULL : (1ULL << to) - 1;
+    uint64_t below = (1ULL << from) - 1;
+    return upto & ~below;
+}
+
+#define DEFINE_UPPER_BOUND_LINES(SLOTS)                                     \
+    __attribute__((target("avx2,popcnt")))                                  \
+    static int node_upper_bound_##SLOTS(const int* keys, int n, int key) {  \
+        uint64_t gt = keys_gt_mask_64(keys, key, SLOTS);                    \
+        return __builtin_popcountll(~gt & lane_range(0, n));                \
     }
 
-    new_node->children[new_node->nkeys] = node->children[node->nkeys];
+DEFINE_UPPER_BOUND_LINES(12)  // 64-byte leaves
+DEFINE_UPPER_BOUND_LINES(28)  // 128-byte leaves
+DEFINE_UPPER_BOUND_LINES(60)  // 256-byte leaves
+#endif
+#endif
 
-    node->keys[node->nkeys / 2] = 0;
-    node->children[node->nkeys / 2 + 1] = NULL;
-    node->children[node->nkeys] = NULL;
+// The same count for packed leaves, over 8- or 16-bit offsets from the
+// leaf's first key. AVX2 compares 32 or 16 offsets at a time (x <= d is
+// max(x, d) == d, which works unsigned); reads may run past n into the
+// leaf's values, and those lanes are masked off.
+typedef int (*DeltaBoundFn)(const void* deltas, int n, uint32_t delta);
 
-    node->nkeys = node->nkeys / 2;
+static int delta_upper_bound8_scalar(const void* deltas, int n, uint32_t delta) {
+    const uint8_t* d = (const uint8_t*)deltas;
+    int i = 0;
+    while (i < n && d[i] <= delta) {
+        i++;
+    }
+    return i;
+}
 
-    return split;
+static int delta_upper_bound16_scalar(const void* deltas, int n, uint32_t delta) {
+    const uint16_t* d = (const uint16_t*)deltas;
+    int i = 0;
+    while (i < n && d[i] <= delta) {
+        i++;
+    }
+    return i;
 }
 
-void node_insert(BPNode* node, int key, BPNode* child) {
-    BPNode* stack[100];
-    int top = 1;
-    stack[0] = NULL;
-    while (node->type != LEAF) {
-        int i = 0;
-        while (i < node->nkeys && key >= node->keys[i]) {
-            i++;
+#if defined(BPTREE_X86) && !defined(BPTREE_NO_SIMD)
+__attribute__((target("avx2")))
+static int delta_upper_bound8_avx2(const void* deltas, int n, uint32_t delta) {
+    const uint8_t* d = (const uint8_t*)deltas;
+    __m256i needle = _mm256_set1_epi8((char)delta);
+    for (int i = 0; i < n; i += 32) {
+        __m256i k = _mm256_loadu_si256((const __m256i*)(d + i));
+        uint32_t gt = ~(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_max_epu8(k, needle), needle));
+        if (n - i < 32) {
+            gt &= (1u << (n - i)) - 1;
+        }
+        if (gt != 0) {
+            return i + __builtin_ctz(gt);
         }
-        stack[top++] = node;
-        node = node->children[i];
     }
+    return n;
+}
 
-    while (top > 0) {
-        BPNode* parent = stack[top - 1];
-        node_insert_entry(node, key, child);
-        if (node->nkeys <= MAX_KEYS) {
-            return;
+// movemask gives two bits per 16-bit lane.
+__attribute__((target("avx2")))
+static int delta_upper_bound16_avx2(const void* deltas, int n, uint32_t delta) {
+    const uint16_t* d = (const uint16_t*)deltas;
+    __m256i needle = _mm256_set1_epi16((short)delta);
+    for (int i = 0; i < n; i += 16) {
+        __m256i k = _mm256_loadu_si256((const __m256i*)(d + i));
+        uint32_t gt = ~(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi16(_mm256_max_epu16(k, needle), needle));
+        if (n - i < 16) {
+            gt &= (1u << (2 * (n - i))) - 1;
         }
-        Split split = node_split(node, key);
-        key = split.key;
-        child = split.right;
-
-        if (parent == NULL) {
-            BPNode* parent = node_new(INTERNAL);
-            parent->children[0] = bptree.root;
-            node_insert_entry(parent, key, child);
-            bptree.root = parent;
-            return;
+        if (gt != 0) {
+            return i + __builtin_ctz(gt) / 2;
         }
-
-        node = stack[--top];
     }
+    return n;
 }
+#endif
 
-void print_tree(BPNode* root, int level);
-
-void bptree_insert(BPTree* bptree, int key) {
-    node_insert(bptree->root, key, NULL);
+static void delta_kernels_for(DeltaBoundFn* bound8, DeltaBoundFn* bound16) {
+#if defined(BPTREE_X86) && !defined(BPTREE_NO_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *bound8 = delta_upper_bound8_avx2;
+        *bound16 = delta_upper_bound16_avx2;
+        return;
+    }
+#endif
+    *bound8 = delta_upper_bound8_scalar;
+    *bound16 = delta_upper_bound16_scalar;
 }
 
-void print_tree(BPNode* root, int level) {
-    if (root == NULL) return;
-    
-    for (int i = 0; i < level; i++) {
-        printf("    ");  // 4 spaces for each level
-    }
-    
-    if (root->type == LEAF) {
-        printf("Leaf [ ");
-    } else {
-        printf("Internal [ ");
+typedef struct SearchKernel {
+    const char* name;
+    int key_slots;  // 0 matches any node size
+    UpperBoundFn upper_bound;
+} SearchKernel;
+
+static SearchKernel search_kernel_for(int key_slots) {
+#if defined(BPTREE_X86) && !defined(BPTREE_NO_SIMD)
+    __builtin_cpu_init();
+#if defined(BPTREE_KEY_U64) || defined(BPTREE_KEY_BYTES16)
+    if (__builtin_cpu_supports("avx2")) {
+        return (SearchKernel){"avx2", 0, node_upper_bound_avx2};
     }
-    
-    for (int i = 0; i < root->nkeys; i++) {
-        printf("%d ", root->keys[i]);
+#else
+    static const SearchKernel sized[] = {
+        {"avx2, 64-byte leaves", 12, node_upper_bound_12},
+        {"avx2, 128-byte leaves", 28, node_upper_bound_28},
+        {"avx2, 256-byte leaves", 60, node_upper_bound_60},
+    };
+
+    if (__builtin_cpu_supports("avx2")) {
+        for (size_t i = 0; i < sizeof(sized) / sizeof(sized[0]); i++) {
+            if (sized[i].key_slots == key_slots) {
+                return sized[i];
+            }
+        }
+        return (SearchKernel){"avx2", 0, node_upper_bound_avx2};
     }
-    printf("]");
-    
-    if (root->type == LEAF && root->next != NULL) {
-        printf(" -> next");
+    if (__builtin_cpu_supports("sse2")) {
+        return (SearchKernel){"sse2", 0, node_upper_bound_sse2};
     }
-    printf("\n");
-    
-    if (root->type != LEAF) {
-        for (int i = 0; i <= root->nkeys; i++) {
-            print_tree(root->children[i], level + 1);
+#endif
+#endif
+    (void)key_slots;
+    return (SearchKernel){"scalar", 0, node_upper_bound_scalar};
+}
+
+// Paged trees (bptree_open_paged) keep only part of a tree file in
+// memory. The top levels are read in when the tree is opened and stay
+// pinned. Every other node is a page, identified by its file offset,
+// and cached in a fixed set of frames: a miss reads the page with pread
+// into the frame the clock hand stops at. A fetched node stays valid
+// until the next fetch, which is all a descent or a scan needs. The
+// pool isn't thread-safe.
+//
+// Pages are found through an open-addressing table (linear probing, at
+// most half full) whose slots hold the page, its frame and its clock
+// bit, so a hit touches one slot and then the frame.
+typedef struct PoolSlot {
+    uint64_t page;        // 0 if the slot is empty
+    int32_t frame;
+    uint32_t referenced;  // Clock bit
+} PoolSlot;
+
+typedef struct BufferPool {
+    int fd;
+    char* pinned;          // File bytes [pinned_start, pinned_end)
+    uint64_t pinned_start;
+    uint64_t pinned_end;
+    size_t page_bytes;     // Frame size: the larger node record
+    char* frames;
+    int* frame_slot;       // Slot of each frame's page, or -1 if empty
+    int frame_count;
+    int hand;
+    PoolSlot* slots;
+    size_t slot_mask;
+    int slot_shift;
+    long hits;             // Counted for pool pages; pinned nodes aren't
+    long misses;
+    long evictions;
+} BufferPool;
+
+// Key filter (bptree_set_filter): a blocked Bloom filter in front of
+// searches, so most searches for keys that aren't there never touch
+// the tree. A key sets `hashes` bits within one 64-byte block chosen by
+// its hash, so checking a key costs one cache miss. Inserts, bulk loads
+// and merges add keys. A delete can't clear bits other keys may share,
+// so deleted keys only count as stale. Once the stale keys, or the keys
+// added, outgrow what the filter was sized for, it is rebuilt from the
+// leaves. Concurrent inserts set their bits atomically and never
+// rebuild it.
+#define FILTER_BLOCK_WORDS 8  // 512 bits
+
+typedef struct KeyFilter {
+    uint64_t* blocks;
+    uint64_t block_count;
+    int hashes;     // Bits set per key
+    long capacity;  // Keys it was sized for
+    long keys;      // Keys added since it was built, deleted or not
+    long stale;     // Keys deleted since it was built
+} KeyFilter;
+
+// Top index (bptree_set_top_index): the upper levels of the tree
+// flattened into one array. The nodes at some depth split the key
+// space at the separators between them; those separators are stored
+// in Eytzinger order (the children of slot k are slots 2k and 2k + 1,
+// a binary search tree laid out breadth first). A search is then a
+// loop of array loads whose next candidates are known in advance and
+// prefetched several steps ahead, instead of a chain of dependent node
+// loads, and goes on from the node it lands on down to a leaf.
+typedef struct TopIndex {
+    bpkey_t* keys;   // Separators in Eytzinger order, from keys[1]
+    BPNode** nodes;  // nodes[k]: the node below keys[k]; nodes[0]: the last node
+    long count;      // Separators, one fewer than the nodes
+    int depth;       // Depth of the nodes it leads to
+} TopIndex;
+
+#define APPEND_PATH_MAX 64
+
+// Snapshot mode (see bptree_snapshot): each reader announces the epoch
+// it started in in a slot of its own line, and nodes replaced by writes
+// wait in the retired list, tagged with their epoch, until no reader is
+// that old.
+#define SNAPSHOT_SLOTS 64
+
+typedef struct SnapshotSlot {
+    _Alignas(CACHE_LINE) uint64_t epoch;  // Epoch its reader started in, 0 if free
+} SnapshotSlot;
+
+typedef struct RetiredNodes {
+    BPNode** nodes;
+    uint64_t* epochs;  // Epoch each node was replaced in
+    long count;
+    long capacity;
+    long reclaim_at;   // count at which the next reclaim runs
+} RetiredNodes;
+
+typedef struct BPTree {
+    BPNode* root;
+    int order;
+    int max_keys;   // 2 * order
+    int key_slots;  // max_keys + 1 (room to overflow before a split), rounded up to KEY_SLOT_MULTIPLE
+    UpperBoundFn upper_bound;
+    UpperBoundFn window_bound;   // For a few keys within a node (leaf models)
+    const char* kernel_name;
+    DeltaBoundFn delta_bound8;   // Packed leaves
+    DeltaBoundFn delta_bound16;
+    bool pack_leaves;               // Pack leaves when they are built or split
+    bool model_leaves;              // Fit leaf models when leaves are built or split
+    int leaf_slots[LEAF_FORMATS];   // Entries a leaf of each format holds; 0 if unused
+    int leaf_max_keys[LEAF_FORMATS];  // Entries before a leaf of each format splits
+    Arena arena;
+    pthread_mutex_t arena_lock;  // Taken by concurrent writers to allocate nodes
+    void* map;                   // File mapping of a tree from bptree_open, or NULL
+    size_t map_bytes;
+    uintptr_t node_base;         // Added to child and next references (see node_child)
+    BufferPool* pool;            // Paged trees (bptree_open_paged), or NULL
+    int filter_bits;             // Bits per key of the key filter, 0 for none
+    KeyFilter* filter;           // Built from filter_bits, or NULL
+    int top_levels;              // Levels the top index replaces, 0 for none
+    TopIndex top;
+    bool top_valid;              // top matches the tree; searches use it
+    long top_stale_writes;       // Writes since it stopped matching
+    BPNode* append_path[APPEND_PATH_MAX];  // Ancestors of append_leaf, as node_insert stacks them
+    BPNode* append_leaf;         // The rightmost leaf (see append_insert)
+    int append_depth;            // Entries in append_path; 0 until it is loaded again
+    int buffer_messages;         // Messages an internal node buffers before a flush, 0 for none
+    long buffered;               // Messages in all buffers
+    SnapshotSlot* snapshot_slots;  // Reader slots in snapshot mode, or NULL
+    uint64_t epoch;              // Advanced by every write in snapshot mode
+    RetiredNodes retired;        // Replaced nodes open snapshots may still read
+} BPTree;
+
+BPTree bptree;
+
+// The nodes of a tree opened from a file (bptree_open) stay in the file
+// mapping, and refer to each other by file offset instead of address.
+// Read paths go through node_child and leaf_next, which add node_base:
+// the mapping's address, or 0 for a tree in memory.
+static inline BPNode* node_child(BPTree* bptree, BPNode* node, int i) {
+    return (BPNode*)((uintptr_t)node_children(node)[i] + bptree->node_base);
+}
+
+static inline BPNode* leaf_next(uintptr_t node_base, BPNode* leaf) {
+    return leaf->next == NULL ? NULL : (BPNode*)((uintptr_t)leaf->next + node_base);
+}
+
+static inline size_t pool_home(BufferPool* pool, uint64_t page) {
+    return (size_t)(((page / CACHE_LINE) * 0x9E3779B97F4A7C15ULL) >> pool->slot_shift);
+}
+
+// Empty a slot, moving later entries of its probe run back into the
+// hole so lookups never need tombstones.
+static void pool_slot_remove(BufferPool* pool, size_t hole) {
+    pool->frame_slot[pool->slots[hole].frame] = -1;
+    for (size_t i = (hole + 1) & pool->slot_mask; pool->slots[i].page != 0;
+         i = (i + 1) & pool->slot_mask) {
+        size_t home = pool_home(pool, pool->slots[i].page);
+        if (((i - home) & pool->slot_mask) >= ((i - hole) & pool->slot_mask)) {
+            pool->slots[hole] = pool->slots[i];
+            pool->frame_slot[pool->slots[hole].frame] = (int)hole;
+            hole = i;
         }
     }
+    pool->slots[hole].page = 0;
 }
 
-void search_and_print(BPTree* bptree, int key) {
-    printf("\nSearching for %d:\n", key);
-
-    Search result = bptree_search(bptree, key);
+// The node at file offset page: pinned, cached, or read in.
+static BPNode* pool_fetch(BufferPool* pool, uint64_t page) {
+    if (page < pool->pinned_end) {
+        return (BPNode*)(pool->pinned + (page - pool->pinned_start));
+    }
+    for (size_t i = pool_home(pool, page); pool->slots[i].page != 0; i = (i + 1) & pool->slot_mask) {
+        if (pool->slots[i].page == page) {
+            pool->slots[i].referenced = 1;
+            pool->hits++;
+            return (BPNode*)(pool->frames + (size_t)pool->slots[i].frame * pool->page_bytes);
+        }
+    }
+    pool->misses++;
 
-    if (result.index == -1) {
-        printf("Key %d not found in the tree\n", key);
-        return;
+    // Move past frames used since the hand last came by, clearing their
+    // bits, and take the first one that wasn't.
+    for (;;) {
+        int slot = pool->frame_slot[pool->hand];
+        if (slot < 0 || !pool->slots[slot].referenced) {
+            break;
+        }
+        pool->slots[slot].referenced = 0;
+        pool->hand = (pool->hand + 1) % pool->frame_count;
+    }
+    int f = pool->hand;
+    pool->hand = (pool->hand + 1) % pool->frame_count;
+    if (pool->frame_slot[f] >= 0) {
+        pool_slot_remove(pool, (size_t)pool->frame_slot[f]);
+        pool->evictions++;
     }
 
-    printf("Found key %d at index %d in leaf node with keys:\n  ", key, result.index);
+    // Records of both node types fit in a frame; reading a whole frame
+    // may take some of the next record along, which is harmless.
+    char* frame = pool->frames + (size_t)f * pool->page_bytes;
+    if (pread(pool->fd, frame, pool->page_bytes, (off_t)page) < (ssize_t)NODE_HEADER_BYTES) {
+        printf("Failed to read tree page at offset %llu\n", (unsigned long long)page);
+        exit(1);
+    }
+    size_t i = pool_home(pool, page);
+    while (pool->slots[i].page != 0) {
+        i = (i + 1) & pool->slot_mask;
+    }
+    pool->slots[i] = (PoolSlot){page, f, 1};
+    pool->frame_slot[f] = (int)i;
+    return (BPNode*)frame;
+}
+
+static inline BPNode* pool_child(BufferPool* pool, BPNode* node, int i) {
+    return pool_fetch(pool, (uint64_t)(uintptr_t)node_children(node)[i]);
+}
+
+// Where a leaf's model sits: the last bytes of the leaf as the arena
+// rounds it, so packed formats can use the rest up to it for values.
+static inline size_t leaf_model_offset(int key_slots) {
+    return ROUND_TO_LINE(leaf_bytes(key_slots)) - sizeof(LeafModel);
+}
+
+BPNode* arena_node_new(Arena* arena, NodeType type, int key_slots) {
+    BPNode* new_node = (BPNode*)arena_alloc(arena, type);
+    new_node->type = type;
+    new_node->format = KEYS_PLAIN;
+    new_node->key_slots = key_slots;
+    atomic_store_explicit(&new_node->version, 0, memory_order_relaxed);
+    new_node->nkeys = 0;
+    new_node->next = NULL;
+    if (type == LEAF) {
+        ((LeafModel*)((char*)new_node + leaf_model_offset(key_slots)))->error = LEAF_MODEL_NONE;
+    } else {
+        node_children(new_node)[0] = NULL;
+        if (arena->pools[INTERNAL].node_bytes >= buffer_node_bytes(key_slots, 0)) {
+            *buffer_count(new_node) = 0;
+        }
+    }
+    return new_node;
+}
+
+BPNode* node_new(BPTree* bptree, NodeType type) {
+    return arena_node_new(&bptree->arena, type, bptree->key_slots);
+}
+
+void node_free(BPTree* bptree, BPNode* node) {
+    arena_free(&bptree->arena, node->type, node);
+}
+
+// max_keys + 1 (room to overflow before a split), rounded up for the kernels.
+static int key_slots_for_order(int order) {
+    int key_slots = 2 * order + 1 + KEY_SLOT_MULTIPLE - 1;
+    return key_slots - key_slots % KEY_SLOT_MULTIPLE;
+}
+
+void bptree_init_order(BPTree* bptree, int order) {
+    int key_slots = key_slots_for_order(order);
+    if (order < 1 || key_slots > MAX_KEY_SLOTS) {
+        printf("Unsupported order: %d\n", order);
+        exit(1);
+    }
+
+    bptree->order = order;
+    bptree->max_keys = 2 * order;
+    bptree->key_slots = key_slots;
+
+    SearchKernel kernel = search_kernel_for(key_slots);
+    bptree->upper_bound = kernel.upper_bound;
+    bptree->window_bound = search_kernel_for(0).upper_bound;
+    bptree->kernel_name = kernel.name;
+
+    arena_init(&bptree->arena, leaf_bytes(key_slots), internal_bytes(key_slots, bptree->max_keys));
+    pthread_mutex_init(&bptree->arena_lock, NULL);
+    bptree->map = NULL;
+    bptree->map_bytes = 0;
+    bptree->node_base = 0;
+    bptree->pool = NULL;
+    bptree->filter_bits = 0;
+    bptree->filter = NULL;
+    bptree->top_levels = 0;
+    bptree->top = (TopIndex){NULL, NULL, 0, 0};
+    bptree->top_valid = false;
+    bptree->top_stale_writes = 0;
+    bptree->append_depth = 0;
+    bptree->buffer_messages = 0;
+    bptree->buffered = 0;
+    bptree->snapshot_slots = NULL;
+    bptree->epoch = 1;
+    bptree->retired = (RetiredNodes){NULL, NULL, 0, 0, 0};
+
+    // Packed leaves take the same space as plain ones. A packed leaf
+    // can hold up to 2 * max_keys - 1 entries, so the halves of a split
+    // always fit in plain leaves, whatever their keys.
+    delta_kernels_for(&bptree->delta_bound8, &bptree->delta_bound16);
+    bptree->pack_leaves = false;
+    bptree->model_leaves = false;
+    bptree->leaf_slots[KEYS_PLAIN] = key_slots;
+    bptree->leaf_max_keys[KEYS_PLAIN] = bptree->max_keys;
+    size_t model_offset = leaf_model_offset(key_slots);
+    for (int format = KEYS_FOR16; format < LEAF_FORMATS; format++) {
+        int slots = 0;
+        while (slots < MAX_KEY_SLOTS &&
+               leaf_values_offset(format, slots + 1) + sizeof(bpval_t) * (slots + 1) <= model_offset) {
+            slots++;
+        }
+        int max_keys = slots - 1 < 2 * bptree->max_keys - 1 ? slots - 1 : 2 * bptree->max_keys - 1;
+        // Vector searches read up to 32 bytes past the offsets.
+        if (max_keys < bptree->max_keys || slots < 4) {
+            slots = 0;
+            max_keys = 0;
+        }
+        bptree->leaf_slots[format] = slots;
+        bptree->leaf_max_keys[format] = max_keys;
+    }
+
+    bptree->root = node_new(bptree, LEAF);
+}
+
+// Pack leaves from now on. Leaves already in the tree keep their format
+// until they are split or the tree is bulk loaded again.
+void bptree_set_leaf_packing(BPTree* bptree, bool pack) {
+    bptree->pack_leaves = pack;
+}
+
+// Fit a key model to each leaf from now on (see leaf_model_fit). Like
+// packing, it reaches the leaves already in the tree as they are split
+// or the tree is bulk loaded again.
+void bptree_set_leaf_models(BPTree* bptree, bool model) {
+    bptree->model_leaves = model;
+}
+
+// Put nodes allocated from now on in 2 MiB pages (see Arena). Nodes
+// already allocated stay where they are, so set this before loading an
+// empty tree: its lone root leaf is moved over.
+void bptree_set_huge_pages(BPTree* bptree, bool huge) {
+    bptree->arena.huge_pages = huge;
+    BPNode* root = bptree->root;
+    if (root != NULL && root->type == LEAF && root->nkeys == 0 && bptree->map == NULL &&
+        bptree->pool == NULL) {
+        arena_release(&bptree->arena);
+        bptree->root = node_new(bptree, LEAF);
+        bptree->append_depth = 0;
+    }
+}
+
+void bptree_init(BPTree* bptree) {
+    bptree_init_order(bptree, ORDER);
+}
+
+// Release every node of the tree at once. The tree keeps its order,
+// filter, top index and snapshot settings, so it can be bulk loaded or
+// initialized again afterwards.
+void bptree_destroy(BPTree* bptree) {
+    arena_release(&bptree->arena);
+    if (bptree->map != NULL) {
+        munmap(bptree->map, bptree->map_bytes);
+        bptree->map = NULL;
+        bptree->map_bytes = 0;
+        bptree->node_base = 0;
+    }
+    if (bptree->pool != NULL) {
+        BufferPool* pool = bptree->pool;
+        close(pool->fd);
+        free(pool->pinned);
+        free(pool->frames);
+        free(pool->frame_slot);
+        free(pool->slots);
+        free(pool);
+        bptree->pool = NULL;
+    }
+    if (bptree->filter != NULL) {
+        free(bptree->filter->blocks);
+        free(bptree->filter);
+        bptree->filter = NULL;
+    }
+    free(bptree->top.keys);
+    free(bptree->top.nodes);
+    bptree->top = (TopIndex){NULL, NULL, 0, 0};
+    bptree->top_valid = false;
+    bptree->append_depth = 0;
+    bptree->buffered = 0;
+    free(bptree->retired.nodes);
+    free(bptree->retired.epochs);
+    bptree->retired = (RetiredNodes){NULL, NULL, 0, 0, 0};
+    bptree->root = NULL;
+}
+
+// Reading leaves in any format. The _as versions take the format and
+// key count from the caller, so optimistic readers can use values they
+// read once and bounded (a writer may repack the leaf under them).
+static inline bpkey_t leaf_key_as(BPNode* leaf, int format, int i) {
+    switch (format) {
+    case KEYS_FOR16:
+        return key_add(leaf->keys[0], ((uint16_t*)leaf_deltas(leaf))[i]);
+    case KEYS_FOR8:
+        return key_add(leaf->keys[0], ((uint8_t*)leaf_deltas(leaf))[i]);
+    default:
+        return leaf->keys[i];
+    }
+}
+
+static inline bpkey_t leaf_key(BPNode* leaf, int i) {
+    return leaf_key_as(leaf, leaf->format, i);
+}
+
+// Leaf key models. Keys loaded in bulk are often close to evenly
+// spaced, so a key's position in a large leaf is nearly a linear
+// function of its distance from the first key. A leaf's model is that
+// line, fitted through the first and last keys and shifted to center
+// the worst misses, plus its error: how far any key is from where
+// the line puts it. A search then only looks at the 2 * error + 1
+// keys around the prediction. A key between two others is predicted
+// between them (the line only goes up), so this holds for keys that
+// aren't in the leaf too. Each insert or delete moves a key by at most
+// one place, so it widens the error by one; past leaf_model_max_error
+// the model is fitted again. A leaf too small to be worth it, or whose
+// keys are too skewed for a line, has no model and is searched whole.
+#define LEAF_MODEL_MIN_KEYS 32
+#define LEAF_MODEL_MIN_ERROR 16
+
+static inline LeafModel* leaf_model(BPTree* bptree, BPNode* leaf) {
+    return (LeafModel*)((char*)leaf + leaf_model_offset(bptree->key_slots));
+}
+
+// Random inserts into evenly spaced keys leave them off the line by
+// about the square root of the leaf's size, so bigger leaves may miss
+// by more: up to 1/16 of the leaf in the window.
+static inline int leaf_model_max_error(int n) {
+    return n / 32 > LEAF_MODEL_MIN_ERROR ? n / 32 : LEAF_MODEL_MIN_ERROR;
+}
+
+// Where the model puts a key delta from the leaf's first key, before
+// the intercept; clamped to [0, n] even if the model is garbage (an
+// optimistic reader may see one half written).
+static inline int leaf_model_guess(float slope, uint64_t delta, int n) {
+    float guess = slope * (float)delta;
+    if (guess >= 0.0f && guess < (float)n) {
+        return (int)guess;
+    }
+    return guess >= 0.0f ? n : 0;
+}
+
+// Fit the leaf's model to its keys, if the tree has model_leaves set.
+static void leaf_model_fit(BPTree* bptree, BPNode* leaf) {
+    int n = leaf->nkeys;
+    uint64_t span;
+    LeafModel* model = leaf_model(bptree, leaf);
+    model->error = LEAF_MODEL_NONE;
+    if (!bptree->model_leaves || n < LEAF_MODEL_MIN_KEYS || !key_delta(leaf->keys[0], leaf_key(leaf, n - 1), &span) ||
+        span == 0) {
+        return;
+    }
+    float slope = (float)(n - 1) / (float)span;
+    int low = 0;
+    int high = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t delta;
+        key_delta(leaf->keys[0], leaf_key(leaf, i), &delta);
+        int miss = i - leaf_model_guess(slope, delta, n);
+        low = miss < low ? miss : low;
+        high = miss > high ? miss : high;
+    }
+    int intercept = low + (high - low) / 2;
+    int error = high - intercept > intercept - low ? high - intercept : intercept - low;
+    // Half the error budget is left for inserts and deletes.
+    if (error <= leaf_model_max_error(n) / 2) {
+        model->slope = slope;
+        model->intercept = (int16_t)intercept;
+        model->error = (uint16_t)error;
+    }
+}
+
+// Key i was inserted or removed, so every other key moved by one place
+// at most. The model measures from the first key, so if that changed
+// (i == 0) it is fitted again.
+static inline void leaf_model_shift(BPTree* bptree, BPNode* leaf, int i) {
+    LeafModel* model = leaf_model(bptree, leaf);
+    if (model->error == LEAF_MODEL_NONE) {
+        return;
+    }
+    if (i == 0 || ++model->error > leaf_model_max_error(leaf->nkeys)) {
+        leaf_model_fit(bptree, leaf);
+    }
+}
+
+// Software counters for tuning node sizes: nodes searched and keys
+// compared by this thread, where a node search of n keys returning i
+// counts the i + 1 keys (at most n) a linear search would compare. The
+// vector kernels compare whole registers, so this is the work the node
+// size implies rather than instructions run. Counting adds to every
+// descent, so only -DBPTREE_COUNTERS builds do it; see PerfCounters.
+typedef struct OpCounters {
+    uint64_t nodes_visited;
+    uint64_t keys_compared;
+} OpCounters;
+
+#ifdef BPTREE_COUNTERS
+static __thread OpCounters op_counters;
+#define COUNT_NODE_SEARCH(n, i) \
+    (op_counters.nodes_visited++, op_counters.keys_compared += (i) < (n) ? (i) + 1 : (n))
+#else
+#define COUNT_NODE_SEARCH(n, i) ((void)0)
+#endif
+
+// Which child of an internal node to descend into for key.
+static inline int node_upper_bound(BPTree* bptree, BPNode* node, bpkey_t key) {
+    int i = bptree->upper_bound(node->keys, node->nkeys, key);
+    COUNT_NODE_SEARCH(node->nkeys, i);
+    return i;
+}
+
+// The number of keys <= key among the leaf's keys [lo, hi).
+static inline int leaf_window_bound(BPTree* bptree, BPNode* leaf, int format, int lo, int hi,
+                                    bpkey_t key, uint64_t delta) {
+    if (format == KEYS_PLAIN) {
+        return lo + bptree->window_bound(leaf->keys + lo, hi - lo, key);
+    }
+    if (format == KEYS_FOR8) {
+        return lo + bptree->delta_bound8((uint8_t*)leaf_deltas(leaf) + lo, hi - lo, (uint32_t)delta);
+    }
+    return lo + bptree->delta_bound16((uint16_t*)leaf_deltas(leaf) + lo, hi - lo, (uint32_t)delta);
+}
+
+// The number of keys <= key, like upper_bound.
+static inline int leaf_upper_bound_as(BPTree* bptree, BPNode* leaf, int format, int n,
+                                      bpkey_t key) {
+    int i;
+    uint64_t delta;
+    const LeafModel* model = leaf_model(bptree, leaf);
+    int error = model->error;
+    if (error != LEAF_MODEL_NONE && !key_lt(key, leaf->keys[0]) &&
+        key_delta(leaf->keys[0], key, &delta) &&
+        (format == KEYS_PLAIN || delta <= format_max_delta(format))) {
+        int guess = leaf_model_guess(model->slope, delta, n) + model->intercept;
+        int lo = guess - error;
+        int hi = guess + error + 1;
+        lo = lo < 0 ? 0 : lo > n ? n : lo;
+        hi = hi < lo ? lo : hi > n ? n : hi;
+        i = leaf_window_bound(bptree, leaf, format, lo, hi, key, delta);
+        // The window's edges are only trusted if the keys beyond them agree.
+        if ((i == lo && lo > 0 && key_lt(key, leaf_key_as(leaf, format, lo - 1))) ||
+            (i == hi && hi < n && !key_lt(key, leaf_key_as(leaf, format, hi)))) {
+            i = leaf_window_bound(bptree, leaf, format, 0, n, key, delta);
+            lo = 0;
+            hi = n;
+        }
+        COUNT_NODE_SEARCH(hi - lo, i - lo);
+        return i;
+    }
+    if (format == KEYS_PLAIN) {
+        i = bptree->upper_bound(leaf->keys, n, key);
+    } else if (key_lt(key, leaf->keys[0])) {
+        i = 0;
+    } else if (!key_delta(leaf->keys[0], key, &delta) || delta > format_max_delta(format)) {
+        i = n;
+    } else {
+        DeltaBoundFn bound = format == KEYS_FOR8 ? bptree->delta_bound8 : bptree->delta_bound16;
+        i = bound(leaf_deltas(leaf), n, (uint32_t)delta);
+    }
+    COUNT_NODE_SEARCH(n, i);
+    return i;
+}
+
+static inline int leaf_upper_bound(BPTree* bptree, BPNode* leaf, bpkey_t key) {
+    return leaf_upper_bound_as(bptree, leaf, leaf->format, leaf->nkeys, key);
+}
+
+static inline int node_max_keys(BPTree* bptree, BPNode* node) {
+    return node->type == LEAF ? bptree->leaf_max_keys[node->format] : bptree->max_keys;
+}
+
+// Narrowest format that holds n keys from lo to hi. Plain leaves need
+// n <= key_slots; past that, only a packed format will do.
+static LeafFormat leaf_format_for(BPTree* bptree, bpkey_t lo, bpkey_t hi, int n) {
+    uint64_t span;
+    if ((bptree->pack_leaves || n > bptree->key_slots) && key_delta(lo, hi, &span)) {
+        for (int format = KEYS_FOR8; format > KEYS_PLAIN; format--) {
+            if (span <= format_max_delta(format) && n <= bptree->leaf_slots[format]) {
+                return (LeafFormat)format;
+            }
+        }
+    }
+    return KEYS_PLAIN;
+}
+
+// Write n sorted keys into an empty or reused leaf, in the narrowest
+// format that holds them. The caller fills in node_values afterwards.
+static void leaf_pack_keys(BPTree* bptree, BPNode* leaf, const bpkey_t* keys, int n) {
+    LeafFormat format = n > 0 ? leaf_format_for(bptree, keys[0], keys[n - 1], n) : KEYS_PLAIN;
+    leaf->format = format;
+    leaf->key_slots = bptree->leaf_slots[format];
+    leaf->nkeys = n;
+
+    if (format == KEYS_PLAIN) {
+        memcpy(leaf->keys, keys, sizeof(bpkey_t) * n);
+        leaf_model_fit(bptree, leaf);
+        return;
+    }
+    leaf->keys[0] = keys[0];
+    for (int i = 0; i < n; i++) {
+        uint64_t delta;
+        key_delta(keys[0], keys[i], &delta);
+        if (format == KEYS_FOR8) {
+            ((uint8_t*)leaf_deltas(leaf))[i] = (uint8_t)delta;
+        } else {
+            ((uint16_t*)leaf_deltas(leaf))[i] = (uint16_t)delta;
+        }
+    }
+    leaf_model_fit(bptree, leaf);
+}
+
+static void leaf_pack(BPTree* bptree, BPNode* leaf, const bpkey_t* keys, const bpval_t* values,
+                      int n) {
+    leaf_pack_keys(bptree, leaf, keys, n);
+    memcpy(node_values(leaf), values, sizeof(bpval_t) * n);
+}
+
+static void leaf_unpack(BPNode* leaf, bpkey_t* keys, bpval_t* values) {
+    for (int i = 0; i < leaf->nkeys; i++) {
+        keys[i] = leaf_key(leaf, i);
+    }
+    memcpy(values, node_values(leaf), sizeof(bpval_t) * leaf->nkeys);
+}
+
+static inline bool leaf_key_fits(BPNode* leaf, bpkey_t key) {
+    uint64_t delta;
+    return !key_lt(key, leaf->keys[0]) && key_delta(leaf->keys[0], key, &delta) &&
+           delta <= format_max_delta(leaf->format);
+}
+
+// Whether the leaf can take key, repacked if need be, and still hold at
+// most capacity[format] entries: leaf_slots when the caller splits an
+// overfull leaf afterwards, leaf_max_keys when it can't (OLC). Plain
+// leaves always can; a packed leaf may be too full to widen its format
+// for a key outside its range, and has to split first.
+static bool leaf_has_room(BPTree* bptree, BPNode* leaf, bpkey_t key, const int* capacity) {
+    int n = leaf->nkeys;
+    if (leaf->format == KEYS_PLAIN || n == 0) {
+        return true;
+    }
+    if (n < capacity[leaf->format] && leaf_key_fits(leaf, key)) {
+        return true;
+    }
+    bpkey_t lo = leaf_key(leaf, 0);
+    bpkey_t hi = leaf_key(leaf, n - 1);
+    lo = key_lt(key, lo) ? key : lo;
+    hi = key_lt(hi, key) ? key : hi;
+    return n + 1 <= capacity[leaf_format_for(bptree, lo, hi, n + 1)];
+}
+
+// Redistribute the entries of two neighboring leaves so the left one
+// has left_count of them, repacking both.
+static void leaf_rebalance(BPTree* bptree, BPNode* left, BPNode* right, int left_count) {
+    int n = left->nkeys + right->nkeys;
+    bpkey_t keys[n];
+    bpval_t values[n];
+    leaf_unpack(left, keys, values);
+    leaf_unpack(right, keys + left->nkeys, values + left->nkeys);
+    leaf_pack(bptree, left, keys, values, left_count);
+    leaf_pack(bptree, right, keys + left_count, values + left_count, n - left_count);
+}
+
+// Pull the first cache lines of a node into cache before we get to it.
+// The size comes from the caller: reading it from the node's header
+// would be the very miss we're trying to avoid.
+static inline void node_prefetch(BPNode* node, size_t bytes, int max_lines) {
+    if (bytes > (size_t)max_lines * CACHE_LINE) {
+        bytes = (size_t)max_lines * CACHE_LINE;
+    }
+    for (size_t offset = 0; offset < bytes; offset += CACHE_LINE) {
+        __builtin_prefetch((char*)node + offset);
+    }
+}
+
+// A found key's leaf and index, and its value copied out of the leaf.
+typedef struct Search {
+    BPNode* node;
+    int index;
+    bpval_t value;
+} Search;
+
+static inline uint64_t* filter_block(const KeyFilter* filter, uint64_t hash) {
+    return filter->blocks + FILTER_BLOCK_WORDS * (((hash >> 32) * filter->block_count) >> 32);
+}
+
+// The i-th bit of a key within its block, by double hashing.
+static inline uint32_t filter_bit(uint64_t mixed, int i) {
+    return ((uint32_t)mixed + (uint32_t)i * ((uint32_t)(mixed >> 32) | 1)) % (FILTER_BLOCK_WORDS * 64);
+}
+
+static inline bool filter_may_contain(const KeyFilter* filter, bpkey_t key) {
+    uint64_t hash = key_hash(key);
+    const uint64_t* block = filter_block(filter, hash);
+    uint64_t mixed = hash64(hash);
+    for (int i = 0; i < filter->hashes; i++) {
+        uint32_t bit = filter_bit(mixed, i);
+        if ((block[bit / 64] & (1ULL << (bit % 64))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void filter_add(KeyFilter* filter, bpkey_t key, bool concurrent) {
+    uint64_t hash = key_hash(key);
+    uint64_t* block = filter_block(filter, hash);
+    uint64_t mixed = hash64(hash);
+    for (int i = 0; i < filter->hashes; i++) {
+        uint32_t bit = filter_bit(mixed, i);
+        if (concurrent) {
+            __atomic_fetch_or(&block[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+        } else {
+            block[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+    if (concurrent) {
+        __atomic_fetch_add(&filter->keys, 1, __ATOMIC_RELAXED);
+    } else {
+        filter->keys++;
+    }
+}
+
+static BPNode* first_leaf(BPTree* bptree) {
+    BPNode* node = bptree->root;
+    while (node->type != LEAF) {
+        node = node_child(bptree, node, 0);
+    }
+    return node;
+}
+
+// Build the filter from the keys in the tree, sized for half as many
+// again so inserts don't trigger a rebuild right away.
+void bptree_flush_buffers(BPTree* bptree);
+
+static void filter_build(BPTree* bptree) {
+    // Keys still in insert buffers would be left out.
+    bptree_flush_buffers(bptree);
+    long count = 0;
+    for (BPNode* leaf = first_leaf(bptree); leaf != NULL; leaf = leaf_next(bptree->node_base, leaf)) {
+        count += leaf->nkeys;
+    }
+
+    KeyFilter* filter = bptree->filter;
+    if (filter == NULL) {
+        filter = (KeyFilter*)calloc(1, sizeof(KeyFilter));
+        bptree->filter = filter;
+    }
+    free(filter->blocks);
+    filter->capacity = count + count / 2 + 1024;
+    filter->block_count = ((uint64_t)filter->capacity * bptree->filter_bits + FILTER_BLOCK_WORDS * 64 - 1) /
+                          (FILTER_BLOCK_WORDS * 64);
+    // ln 2 * bits per key minimizes false positives.
+    filter->hashes = (int)(bptree->filter_bits * 0.69 + 0.5);
+    if (filter->hashes < 1) {
+        filter->hashes = 1;
+    }
+    if (filter->hashes > 16) {
+        filter->hashes = 16;
+    }
+    size_t bytes = filter->block_count * FILTER_BLOCK_WORDS * sizeof(uint64_t);
+    void* blocks = NULL;
+    if (posix_memalign(&blocks, CACHE_LINE, bytes) != 0) {
+        printf("Failed to allocate key filter\n");
+        exit(1);
+    }
+    memset(blocks, 0, bytes);
+    filter->blocks = (uint64_t*)blocks;
+    filter->keys = 0;
+    filter->stale = 0;
+
+    for (BPNode* leaf = first_leaf(bptree); leaf != NULL; leaf = leaf_next(bptree->node_base, leaf)) {
+        for (int i = 0; i < leaf->nkeys; i++) {
+            filter_add(filter, leaf_key(leaf, i), false);
+        }
+    }
+}
+
+// Rebuild the filter once it holds more keys, or more deleted ones,
+// than it was sized for.
+static void filter_maintain(BPTree* bptree) {
+    KeyFilter* filter = bptree->filter;
+    if (filter != NULL && (filter->keys > filter->capacity || filter->stale > filter->capacity / 4)) {
+        filter_build(bptree);
+    }
+}
+
+// Put a key filter with bits_per_key bits per key (10 gives about 1%
+// false positives) in front of the tree's searches, or remove it with
+// 0. It is rebuilt whenever the tree is bulk loaded.
+void bptree_set_filter(BPTree* bptree, int bits_per_key) {
+    bptree->filter_bits = bits_per_key > 0 ? bits_per_key : 0;
+    if (bptree->filter_bits > 0) {
+        filter_build(bptree);
+    } else if (bptree->filter != NULL) {
+        free(bptree->filter->blocks);
+        free(bptree->filter);
+        bptree->filter = NULL;
+    }
+}
+
+#define TOP_KEYS_PER_LINE (CACHE_LINE / sizeof(bpkey_t))
+
+// Nodes in key order and the smallest key under each: a level of the
+// tree (the top index), or the nodes that take one node's place in its
+// parent (bptree_merge), which keeps its separator for the first, so
+// there lows[0] only matters above the root.
+typedef struct NodeRun {
+    BPNode** nodes;
+    bpkey_t* lows;
+    long count;
+    long capacity;
+} NodeRun;
+
+static void run_push(NodeRun* run, BPNode* node, bpkey_t low) {
+    if (run->count == run->capacity) {
+        run->capacity = run->capacity == 0 ? 16 : 2 * run->capacity;
+        run->nodes = (BPNode**)realloc(run->nodes, sizeof(BPNode*) * run->capacity);
+        run->lows = (bpkey_t*)realloc(run->lows, sizeof(bpkey_t) * run->capacity);
+        if (run->nodes == NULL || run->lows == NULL) {
+            printf("Failed to allocate node run\n");
+            exit(1);
+        }
+    }
+    run->nodes[run->count] = node;
+    run->lows[run->count++] = low;
+}
+
+static void run_free(NodeRun* run) {
+    free(run->nodes);
+    free(run->lows);
+}
+
+// Collect the nodes at depth below node (at node_depth), whose smallest
+// key is low.
+static void top_index_collect(BPTree* bptree, BPNode* node, int node_depth, int depth,
+                              bpkey_t low, NodeRun* out) {
+    if (node_depth == depth) {
+        run_push(out, node, low);
+        return;
+    }
+    for (int i = 0; i <= node->nkeys; i++) {
+        top_index_collect(bptree, node_child(bptree, node, i), node_depth + 1, depth,
+                          i == 0 ? low : node->keys[i - 1], out);
+    }
+}
+
+// Lay the separators out in Eytzinger order: an in-order walk of the
+// implicit tree rooted at slot k visits them in sorted order. Returns
+// the next sorted position.
+static long top_index_fill(TopIndex* top, const NodeRun* run, long k, long i) {
+    if (k > top->count) {
+        return i;
+    }
+    i = top_index_fill(top, run, 2 * k, i);
+    // Separator i lies between nodes i and i + 1, and a key below it
+    // (but not below the one before) belongs to node i.
+    top->keys[k] = run->lows[i + 1];
+    top->nodes[k] = run->nodes[i];
+    return top_index_fill(top, run, 2 * k + 1, i + 1);
+}
+
+// Build the top index for the tree as it is. It leads to the nodes
+// top_levels down, or to the leaves if the tree isn't that tall.
+static void top_index_build(BPTree* bptree) {
+    int height = 1;
+    for (BPNode* node = bptree->root; node->type != LEAF; node = node_child(bptree, node, 0)) {
+        height++;
+    }
+    int depth = bptree->top_levels < height - 1 ? bptree->top_levels : height - 1;
+    bptree->top_stale_writes = 0;
+    bptree->top_valid = false;
+    if (depth == 0) {
+        return;
+    }
+
+    NodeRun run = {0};
+    top_index_collect(bptree, bptree->root, 0, depth, KEY_ZERO, &run);
+    TopIndex* top = &bptree->top;
+    free(top->keys);
+    free(top->nodes);
+    top->count = run.count - 1;
+    top->depth = depth;
+    size_t key_bytes = sizeof(bpkey_t) * (run.count + TOP_KEYS_PER_LINE);
+    if (posix_memalign((void**)&top->keys, CACHE_LINE, key_bytes - key_bytes % CACHE_LINE) != 0) {
+        printf("Failed to allocate the top index\n");
+        exit(1);
+    }
+    top->nodes = (BPNode**)malloc(sizeof(BPNode*) * run.count);
+    top->nodes[0] = run.nodes[run.count - 1];
+    top_index_fill(top, &run, 1, 0);
+    run_free(&run);
+    bptree->top_valid = true;
+}
+
+// The tree changed at depth: the top index no longer matches it if
+// nodes it leads to, or nodes above them, were split or merged.
+static inline void top_index_changed(BPTree* bptree, int depth) {
+    if (bptree->top_valid && depth <= bptree->top.depth) {
+        __atomic_store_n(&bptree->top_valid, false, __ATOMIC_RELAXED);
+    }
+}
+
+// Nodes at depth were split or merged: the top index may no longer
+// match, and the path to the rightmost leaf may have moved.
+static inline void tree_shape_changed(BPTree* bptree, int depth) {
+    top_index_changed(bptree, depth);
+    if (bptree->append_depth != 0) {
+        __atomic_store_n(&bptree->append_depth, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// After a write: rebuild a stale top index once enough writes have
+// gone by that the rebuild costs a few steps per write.
+static void top_index_maintain(BPTree* bptree) {
+    if (bptree->top_levels > 0 && !bptree->top_valid &&
+        ++bptree->top_stale_writes > bptree->top.count / 4) {
+        top_index_build(bptree);
+    }
+}
+
+// Flatten the top levels (0 for none) of the tree into a top index,
+// now and whenever it is loaded or changed enough. Searches, seeks and
+// batched searches start from it; the concurrent calls don't.
+void bptree_set_top_index(BPTree* bptree, int levels) {
+    bptree->top_levels = levels > 0 ? levels : 0;
+    bptree->top_valid = false;
+    if (bptree->top_levels > 0 && bptree->root != NULL && bptree->pool == NULL) {
+        top_index_build(bptree);
+    }
+}
+
+// Where a descent for key starts: the node the top index leads to, or
+// the root. Going right at every separator <= key, the search ends
+// past the last separator it went left at, the first one > key;
+// shifting off the trailing right turns (and the left one) gives its
+// slot, or 0 if there is none.
+static inline BPNode* descent_start(BPTree* bptree, bpkey_t key) {
+    if (!bptree->top_valid) {
+        return bptree->root;
+    }
+    const TopIndex* top = &bptree->top;
+    long k = 1;
+    while (k <= top->count) {
+        __builtin_prefetch(top->keys + TOP_KEYS_PER_LINE * k);
+        k = 2 * k + !key_lt(key, top->keys[k]);
+    }
+    k >>= __builtin_ffsl(~k);
+    return top->nodes[k];
+}
+
+static inline Search leaf_find(BPTree* bptree, BPNode* leaf, bpkey_t key) {
+    int i = leaf_upper_bound(bptree, leaf, key) - 1;
+    if (i >= 0 && key_eq(leaf_key(leaf, i), key)) {
+        return (Search){leaf, i, node_values(leaf)[i]};
+    }
+    return (Search){NULL, -1, 0};
+}
+
+// bptree_search and bptree_scan for paged trees: the same walks, with
+// every node after the pinned levels fetched through the pool.
+static Search paged_search(BPTree* bptree, bpkey_t key) {
+    BPNode* node = bptree->root;
+    while (node->type != LEAF) {
+        node = pool_child(bptree->pool, node, node_upper_bound(bptree, node, key));
+    }
+    return leaf_find(bptree, node, key);
+}
+
+static int paged_scan(BPTree* bptree, bpkey_t lo, bpkey_t hi, bpkey_t* out_keys,
+                      bpval_t* out_values, int max) {
+    BPNode* node = bptree->root;
+    while (node->type != LEAF) {
+        node = pool_child(bptree->pool, node, node_upper_bound(bptree, node, lo));
+    }
+    int i = 0;
+    while (i < node->nkeys && key_lt(leaf_key(node, i), lo)) {
+        i++;
+    }
+
+    int n = 0;
+    for (;;) {
+        bpval_t* values = node_values(node);
+        for (; i < node->nkeys && n < max; i++) {
+            bpkey_t key = leaf_key(node, i);
+            if (key_lt(hi, key)) {
+                return n;
+            }
+            if (out_values != NULL) {
+                out_values[n] = values[i];
+            }
+            out_keys[n++] = key;
+        }
+        if (n == max || node->next == NULL) {
+            return n;
+        }
+        node = pool_fetch(bptree->pool, (uint64_t)(uintptr_t)node->next);
+        i = 0;
+    }
+}
+
+// A search with insert buffers: the newest message for key on the way
+// down decides, before the leaf is reached. A key found in a buffer
+// comes back with node set to the internal node and index to its place
+// in the buffer. The top index is passed over, since it would skip the
+// buffers of the levels it replaces.
+static Search buffered_search(BPTree* bptree, bpkey_t key) {
+    int slots = 2 * bptree->buffer_messages;
+    BPNode* node = bptree->root;
+    while (node->type != LEAF) {
+        bpkey_t* keys = buffer_keys(node);
+        for (int i = *buffer_count(node) - 1; i >= 0; i--) {
+            if (key_eq(keys[i], key)) {
+                if (buffer_kinds(node, slots)[i] == MESSAGE_DELETE) {
+                    return (Search){NULL, -1, 0};
+                }
+                return (Search){node, i, buffer_values(node, slots)[i]};
+            }
+        }
+        node = node_children(node)[node_upper_bound(bptree, node, key)];
+    }
+    return leaf_find(bptree, node, key);
+}
+
+Search bptree_search(BPTree* bptree, bpkey_t key) {
+    if (bptree->filter != NULL && !filter_may_contain(bptree->filter, key)) {
+        return (Search){NULL, -1, 0};
+    }
+    if (bptree->pool != NULL) {
+        return paged_search(bptree, key);
+    }
+    if (bptree->buffered > 0) {
+        return buffered_search(bptree, key);
+    }
+    BPNode* node = descent_start(bptree, key);
+    while (node->type != LEAF) {
+        node = node_child(bptree, node, node_upper_bound(bptree, node, key));
+    }
+    return leaf_find(bptree, node, key);
+}
+
+// Look up n keys at once, writing one Search per key to results.
+//
+// A single search stalls on a cache miss at every level. Here a group of
+// lookups goes down the tree together, one level at a time: first every
+// lookup searches its node and prefetches the child pointer it needs,
+// then every lookup follows its pointer and prefetches the child node.
+// By the time a lookup touches a node, the loads for the rest of the
+// group are already in flight. Every leaf is at the same depth, so the
+// whole group reaches the leaves in the same step.
+#define BATCH_GROUP 16
+#define BATCH_PREFETCH_LINES 8
+
+void bptree_search_batch(BPTree* bptree, const bpkey_t* keys, int n, Search* results) {
+    if (bptree->buffered > 0) {
+        bptree_flush_buffers(bptree);
+    }
+    BPNode* nodes[BATCH_GROUP];
+    int slots[BATCH_GROUP];
+    // Header and keys; the same span for leaves and internal nodes.
+    size_t key_bytes = node_children_offset(bptree->key_slots);
+
+    for (int start = 0; start < n; start += BATCH_GROUP) {
+        int count = n - start < BATCH_GROUP ? n - start : BATCH_GROUP;
+        const bpkey_t* group = keys + start;
+
+        // The top index leads every lookup to the same depth.
+        for (int g = 0; g < count; g++) {
+            nodes[g] = descent_start(bptree, group[g]);
+        }
+
+        while (nodes[0]->type != LEAF) {
+            for (int g = 0; g < count; g++) {
+                BPNode* node = nodes[g];
+                slots[g] = node_upper_bound(bptree, node, group[g]);
+                __builtin_prefetch(&node_children(node)[slots[g]]);
+            }
+            for (int g = 0; g < count; g++) {
+                BPNode* child = node_child(bptree, nodes[g], slots[g]);
+                node_prefetch(child, key_bytes, BATCH_PREFETCH_LINES);
+                nodes[g] = child;
+            }
+        }
+
+        // Start the value loads before any of them is needed.
+        for (int g = 0; g < count; g++) {
+            BPNode* leaf = nodes[g];
+            slots[g] = leaf_upper_bound(bptree, leaf, group[g]) - 1;
+            __builtin_prefetch(&node_values(leaf)[slots[g] < 0 ? 0 : slots[g]]);
+        }
+        for (int g = 0; g < count; g++) {
+            BPNode* leaf = nodes[g];
+            int i = slots[g];
+            if (i >= 0 && key_eq(leaf_key(leaf, i), group[g])) {
+                results[start + g] = (Search){leaf, i, node_values(leaf)[i]};
+            } else {
+                results[start + g] = (Search){NULL, -1, 0};
+            }
+        }
+    }
+}
+
+// Scans prefetch the next leaf so walking the leaf chain doesn't
+// stall on every hop. All leaves of a tree have the same key_slots.
+#define SCAN_PREFETCH_LINES 4
+
+static inline void leaf_prefetch(BPNode* leaf, int key_slots) {
+    node_prefetch(leaf, leaf_bytes(key_slots), SCAN_PREFETCH_LINES);
+}
+
+// A cursor points at one key in a leaf. Once it walks off the
+// last leaf, node is NULL.
+typedef struct Cursor {
+    BPNode* node;
+    int index;
+    uintptr_t node_base;  // The tree's, for following next links
+} Cursor;
+
+bool cursor_valid(Cursor* cursor) {
+    return cursor->node != NULL;
+}
+
+bpkey_t cursor_key(Cursor* cursor) {
+    return leaf_key(cursor->node, cursor->index);
+}
+
+bpval_t cursor_value(Cursor* cursor) {
+    return node_values(cursor->node)[cursor->index];
+}
+
+// Skip forward over exhausted (or empty) leaves.
+static void cursor_settle(Cursor* cursor) {
+    while (cursor->node != NULL && cursor->index >= cursor->node->nkeys) {
+        cursor->node = leaf_next(cursor->node_base, cursor->node);
+        cursor->index = 0;
+        if (cursor->node != NULL && cursor->node->next != NULL) {
+            leaf_prefetch(leaf_next(cursor->node_base, cursor->node), cursor->node->key_slots);
+        }
+    }
+}
+
+void cursor_next(Cursor* cursor) {
+    cursor->index++;
+    cursor_settle(cursor);
+}
+
+// Position a cursor on the first key >= key. Buffered messages are
+// flushed to the leaves first.
+Cursor bptree_seek(BPTree* bptree, bpkey_t key) {
+    if (bptree->buffered > 0) {
+        bptree_flush_buffers(bptree);
+    }
+    BPNode* node = descent_start(bptree, key);
+    while (node->type != LEAF) {
+        node = node_child(bptree, node, node_upper_bound(bptree, node, key));
+    }
+
+    if (node->next != NULL) {
+        leaf_prefetch(leaf_next(bptree->node_base, node), node->key_slots);
+    }
+
+    int i = 0;
+    while (i < node->nkeys && key_lt(leaf_key(node, i), key)) {
+        i++;
+    }
+
+    Cursor cursor = {node, i, bptree->node_base};
+    cursor_settle(&cursor);
+    return cursor;
+}
+
+// Copy up to max keys in [lo, hi] into out_keys, in order, and their
+// values into out_values (which may be NULL).
+// One descent to find lo, then sequential reads along the leaf chain.
+int bptree_scan(BPTree* bptree, bpkey_t lo, bpkey_t hi, bpkey_t* out_keys,
+                bpval_t* out_values, int max) {
+    if (bptree->pool != NULL) {
+        return paged_scan(bptree, lo, hi, out_keys, out_values, max);
+    }
+    Cursor cursor = bptree_seek(bptree, lo);
+    BPNode* node = cursor.node;
+    int i = cursor.index;
+    int n = 0;
+
+    while (node != NULL && n < max) {
+        if (node->next != NULL) {
+            leaf_prefetch(leaf_next(bptree->node_base, node), node->key_slots);
+        }
+        bpval_t* values = node_values(node);
+        for (; i < node->nkeys && n < max; i++) {
+            bpkey_t key = leaf_key(node, i);
+            if (key_lt(hi, key)) {
+                return n;
+            }
+            if (out_values != NULL) {
+                out_values[n] = values[i];
+            }
+            out_keys[n++] = key;
+        }
+        node = leaf_next(bptree->node_base, node);
+        i = 0;
+    }
+
+    return n;
+}
+
+// Add key and its value to a leaf, which must have room for it
+// (leaf_has_room). Equal keys go after the ones already there.
+void leaf_insert_entry(BPTree* bptree, BPNode* leaf, bpkey_t key, bpval_t value) {
+    int i = leaf_upper_bound(bptree, leaf, key);
+    int n = leaf->nkeys;
+    bpval_t* values = node_values(leaf);
+
+    if (leaf->format == KEYS_PLAIN) {
+        for (int j = n; j > i; j--) {
+            leaf->keys[j] = leaf->keys[j - 1];
+            values[j] = values[j - 1];
+        }
+        leaf->keys[i] = key;
+    } else if (n < leaf->key_slots && leaf_key_fits(leaf, key)) {
+        uint64_t delta;
+        key_delta(leaf->keys[0], key, &delta);
+        int width = format_delta_bytes(leaf->format);
+        char* deltas = (char*)leaf_deltas(leaf);
+        memmove(deltas + (i + 1) * width, deltas + i * width, (size_t)(n - i) * width);
+        memmove(values + i + 1, values + i, sizeof(bpval_t) * (n - i));
+        if (width == 1) {
+            ((uint8_t*)deltas)[i] = (uint8_t)delta;
+        } else {
+            ((uint16_t*)deltas)[i] = (uint16_t)delta;
+        }
+    } else {
+        // Outside the leaf's range: repack around it.
+        bpkey_t keys[n + 1];
+        bpval_t new_values[n + 1];
+        leaf_unpack(leaf, keys, new_values);
+        memmove(keys + i + 1, keys + i, sizeof(bpkey_t) * (n - i));
+        memmove(new_values + i + 1, new_values + i, sizeof(bpval_t) * (n - i));
+        keys[i] = key;
+        new_values[i] = value;
+        leaf_pack(bptree, leaf, keys, new_values, n + 1);
+        return;
+    }
+    values[i] = value;
+    leaf->nkeys++;
+    leaf_model_shift(bptree, leaf, i);
+}
+
+// Add a separator key and the child to its right to an internal node.
+void node_insert_entry(BPTree* bptree, BPNode* node, bpkey_t key, BPNode* child) {
+    int i = bptree->upper_bound(node->keys, node->nkeys, key);
+    BPNode** children = node_children(node);
+
+    for (int j = node->nkeys; j > i; j--) {
+        node->keys[j] = node->keys[j - 1];
+        children[j + 1] = children[j];
+    }
+    node->keys[i] = key;
+    children[i + 1] = child;
+    node->nkeys++;
+}
+
+typedef struct Split {
+    BPNode* right;
+    bpkey_t key;
+} Split;
+
+// Split a leaf in two after its first left entries, repacking both.
+static Split leaf_split_packed(BPTree* bptree, BPNode* leaf, BPNode* new_leaf, int left) {
+    int n = leaf->nkeys;
+    bpkey_t keys[n];
+    bpval_t values[n];
+    leaf_unpack(leaf, keys, values);
+    leaf_pack(bptree, leaf, keys, values, left);
+    leaf_pack(bptree, new_leaf, keys + left, values + left, n - left);
+    return (Split){new_leaf, keys[left]};
+}
+
+// Where a node split on the append path is cut: keys only ever go to
+// the right of it, so an even split would leave every node behind the
+// rightmost half empty for good. The left node keeps about 90%, and
+// the right one at least a key.
+static int append_split_left(BPNode* node) {
+    int right = node->nkeys / 10 > 0 ? node->nkeys / 10 : 1;
+    return node->type == LEAF ? node->nkeys - right : node->nkeys - right - 1;
+}
+
+// Move the messages for keys from key up to the new node right of node.
+static void buffer_split(BPTree* bptree, BPNode* node, BPNode* right, bpkey_t key) {
+    int slots = 2 * bptree->buffer_messages;
+    bpkey_t* keys = buffer_keys(node);
+    bpval_t* values = buffer_values(node, slots);
+    uint8_t* kinds = buffer_kinds(node, slots);
+    int count = *buffer_count(node);
+    int kept = 0;
+    int moved = 0;
+    for (int i = 0; i < count; i++) {
+        if (key_lt(keys[i], key)) {
+            keys[kept] = keys[i];
+            values[kept] = values[i];
+            kinds[kept++] = kinds[i];
+        } else {
+            buffer_keys(right)[moved] = keys[i];
+            buffer_values(right, slots)[moved] = values[i];
+            buffer_kinds(right, slots)[moved++] = kinds[i];
+        }
+    }
+    *buffer_count(node) = kept;
+    *buffer_count(right) = moved;
+}
+
+// Split a node in two, leaving left keys in it. In an internal node,
+// the key after those moves up instead of to the new node.
+static Split node_split_at(BPTree* bptree, BPNode* node, int left) {
+    BPNode* new_node = node_new(bptree, node->type);
+
+    if (node->type == LEAF) {
+        new_node->next = node->next;
+        node->next = new_node;
+        if (bptree->pack_leaves || node->format != KEYS_PLAIN) {
+            return leaf_split_packed(bptree, node, new_node, left);
+        }
+    }
+
+    Split split;
+    split.right = new_node;
+    split.key = node->keys[left];
+
+    // If the node is an internal node, we need to MOVE
+    // the first key to the parent node.
+    int key_copy_start = left;
+    if (node->type == INTERNAL) {
+        key_copy_start++;
+    }
+
+    for (int i = key_copy_start; i < node->nkeys; i++) {
+        new_node->keys[new_node->nkeys++] = node->keys[i];
+        node->keys[i] = KEY_ZERO;
+    }
+
+    if (node->type == INTERNAL) {
+        BPNode** children = node_children(node);
+        BPNode** new_children = node_children(new_node);
+        for (int i = key_copy_start; i <= node->nkeys; i++) {
+            new_children[i - key_copy_start] = children[i];
+            children[i] = NULL;
+        }
+        if (bptree->buffer_messages > 0) {
+            buffer_split(bptree, node, new_node, split.key);
+        }
+    } else {
+        memcpy(node_values(new_node), node_values(node) + key_copy_start,
+               sizeof(bpval_t) * new_node->nkeys);
+    }
+
+    node->keys[left] = KEY_ZERO;
+    node->nkeys = left;
+    if (node->type == LEAF) {
+        leaf_model_fit(bptree, node);
+        leaf_model_fit(bptree, new_node);
+    }
+
+    return split;
+}
+
+Split node_split(BPTree* bptree, BPNode* node) {
+    return node_split_at(bptree, node, node->nkeys / 2);
+}
+
+// Split node, which has overflowed, and then each ancestor that
+// overflows in turn. stack holds the ancestors below stack[top - 1],
+// with NULL in stack[0] standing for the parent of the root. On the
+// append path, every node split is the rightmost of its level.
+static void node_split_up(BPTree* bptree, BPNode** stack, int top, BPNode* node, bool append) {
+    do {
+        BPNode* parent = stack[--top];
+        tree_shape_changed(bptree, top);
+        Split split = node_split_at(bptree, node,
+                                    append ? append_split_left(node) : node->nkeys / 2);
+
+        if (parent == NULL) {
+            parent = node_new(bptree, INTERNAL);
+            node_children(parent)[0] = bptree->root;
+            node_insert_entry(bptree, parent, split.key, split.right);
+            bptree->root = parent;
+            return;
+        }
+
+        node_insert_entry(bptree, parent, split.key, split.right);
+        node = parent;
+    } while (node->nkeys > bptree->max_keys);
+}
+
+void node_insert(BPTree* bptree, BPNode* node, bpkey_t key, bpval_t value) {
+    BPNode* stack[100];
+    int top = 1;
+    stack[0] = NULL;
+    while (node->type != LEAF) {
+        int i = node_upper_bound(bptree, node, key);
+        stack[top++] = node;
+        node = node_children(node)[i];
+    }
+
+    if (!leaf_has_room(bptree, node, key, bptree->leaf_slots)) {
+        // A packed leaf too full to widen its format for key:
+        // split it, then start over from the root.
+        node_split_up(bptree, stack, top, node, false);
+        node_insert(bptree, bptree->root, key, value);
+        return;
+    }
+
+    leaf_insert_entry(bptree, node, key, value);
+    if (node->nkeys > node_max_keys(bptree, node)) {
+        node_split_up(bptree, stack, top, node, false);
+    }
+}
+
+// Appends: a key above every key in the tree goes straight into the
+// rightmost leaf, through the path to it kept from the last append
+// instead of a search from the root. Splits on the way up leave the
+// left nodes nearly full (append_split_left). The path is dropped
+// whenever the shape of the tree changes, and found again by following
+// the last child of each node down.
+static bool append_path_load(BPTree* bptree) {
+    int top = 0;
+    bptree->append_path[top++] = NULL;
+    BPNode* node = bptree->root;
+    while (node->type != LEAF) {
+        if (top == APPEND_PATH_MAX) {
+            return false;
+        }
+        bptree->append_path[top++] = node;
+        node = node_children(node)[node->nkeys];
+    }
+    bptree->append_leaf = node;
+    bptree->append_depth = top;
+    return true;
+}
+
+static bool append_insert(BPTree* bptree, bpkey_t key, bpval_t value) {
+    if (bptree->append_depth == 0 && !append_path_load(bptree)) {
+        return false;
+    }
+    BPNode* leaf = bptree->append_leaf;
+    if (leaf->nkeys == 0 || !key_lt(leaf_key(leaf, leaf->nkeys - 1), key) ||
+        !leaf_has_room(bptree, leaf, key, bptree->leaf_slots)) {
+        return false;
+    }
+    leaf_insert_entry(bptree, leaf, key, value);
+    if (leaf->nkeys > node_max_keys(bptree, leaf)) {
+        node_split_up(bptree, bptree->append_path, bptree->append_depth, leaf, true);
+    }
+    return true;
+}
+
+// Insert buffers (B-epsilon mode). A random insert normally pays for a
+// cold descent to its leaf. With buffers, inserts and deletes become
+// messages appended to the root's buffer. A full buffer is emptied into
+// the buffers of its children, or at the bottom into the leaves, so
+// each node on the way is reached once per batch rather than once per
+// key, and messages for the same leaf arrive together. A buffer is
+// oldest first and newer than every buffer below it, so a search takes
+// the first message for its key it meets on the way down.
+//
+// Leaves that would split get their messages through the usual insert
+// path; a split node's buffer is split with it (buffer_split). A delete
+// that reaches a leaf just removes the entry: leaves aren't merged, so
+// deletes can leave some underfull until the next bulk load.
+#define MAX_BUFFER_MESSAGES 1024
+
+void node_remove_entry(BPNode* node, int i);
+
+// Apply a message to leaf, or if leaf is NULL or can't take it without
+// a split, to the leaf found from the root. Returns false in that case,
+// since splits may have moved the node's other children.
+static bool buffer_apply(BPTree* bptree, BPNode* leaf, bpkey_t key, bpval_t value, int kind) {
+    if (kind == MESSAGE_INSERT) {
+        if (leaf != NULL && leaf->nkeys < node_max_keys(bptree, leaf) &&
+            leaf_has_room(bptree, leaf, key, bptree->leaf_max_keys)) {
+            leaf_insert_entry(bptree, leaf, key, value);
+            return true;
+        }
+        node_insert(bptree, bptree->root, key, value);
+        return false;
+    }
+    bool direct = leaf != NULL;
+    if (!direct) {
+        leaf = bptree->root;
+        while (leaf->type != LEAF) {
+            leaf = node_children(leaf)[node_upper_bound(bptree, leaf, key)];
+        }
+    }
+    int i = leaf_upper_bound(bptree, leaf, key) - 1;
+    if (i >= 0 && key_eq(leaf_key(leaf, i), key)) {
+        node_remove_entry(leaf, i);
+        leaf_model_shift(bptree, leaf, i);
+    }
+    return direct;
+}
+
+// Move every message in node's buffer down a level. A child whose
+// buffer hasn't room for its share is emptied first, and a child left
+// holding buffer_messages or more is emptied after.
+static void buffer_empty(BPTree* bptree, BPNode* node) {
+    int slots = 2 * bptree->buffer_messages;
+    int count;
+    int fanout;
+    int routes[slots];
+    int starts[bptree->max_keys + 3];
+    for (;;) {
+        count = *buffer_count(node);
+        fanout = node->nkeys + 1;
+        if (count == 0) {
+            return;
+        }
+        memset(starts, 0, sizeof(int) * (fanout + 1));
+        for (int i = 0; i < count; i++) {
+            routes[i] = node_upper_bound(bptree, node, buffer_keys(node)[i]);
+            starts[routes[i] + 1]++;
+        }
+        int full = -1;
+        for (int c = 0; c < fanout && node_children(node)[0]->type == INTERNAL; c++) {
+            if (starts[c + 1] > slots - *buffer_count(node_children(node)[c])) {
+                full = c;
+                break;
+            }
+        }
+        if (full < 0) {
+            break;
+        }
+        buffer_empty(bptree, node_children(node)[full]);
+    }
+
+    // Sort by child, keeping the order of each child's messages.
+    for (int c = 0; c < fanout; c++) {
+        starts[c + 1] += starts[c];
+    }
+    bpkey_t keys[count];
+    bpval_t values[count];
+    uint8_t kinds[count];
+    int sorted_routes[count];
+    for (int i = 0; i < count; i++) {
+        int j = starts[routes[i]]++;
+        sorted_routes[j] = routes[i];
+        keys[j] = buffer_keys(node)[i];
+        values[j] = buffer_values(node, slots)[i];
+        kinds[j] = buffer_kinds(node, slots)[i];
+    }
+    *buffer_count(node) = 0;
+
+    BPNode** children = node_children(node);
+    if (children[0]->type == LEAF) {
+        bool direct = true;
+        for (int i = 0; i < count; i++) {
+            BPNode* leaf = direct ? children[sorted_routes[i]] : NULL;
+            direct = buffer_apply(bptree, leaf, keys[i], values[i], kinds[i]);
+        }
+        bptree->buffered -= count;
+        return;
+    }
+
+    // starts[c] is now where child c's messages end.
+    for (int c = 0, i = 0; c < fanout; c++) {
+        BPNode* child = children[c];
+        int n = starts[c] - i;
+        int end = *buffer_count(child);
+        memcpy(buffer_keys(child) + end, keys + i, sizeof(bpkey_t) * n);
+        memcpy(buffer_values(child, slots) + end, values + i, sizeof(bpval_t) * n);
+        memcpy(buffer_kinds(child, slots) + end, kinds + i, n);
+        *buffer_count(child) = end + n;
+        i = starts[c];
+    }
+    // Right to left: a split adds children to the right of the one
+    // split, and if node splits, it keeps the ones to the left.
+    for (int c = node->nkeys; c >= 0; c--) {
+        if (c > node->nkeys) {
+            c = node->nkeys;
+        }
+        BPNode* child = node_children(node)[c];
+        if (*buffer_count(child) >= bptree->buffer_messages) {
+            buffer_empty(bptree, child);
+        }
+    }
+}
+
+static void buffer_write(BPTree* bptree, bpkey_t key, bpval_t value, int kind) {
+    int slots = 2 * bptree->buffer_messages;
+    BPNode* root = bptree->root;
+    int i = (*buffer_count(root))++;
+    buffer_keys(root)[i] = key;
+    buffer_values(root, slots)[i] = value;
+    buffer_kinds(root, slots)[i] = (uint8_t)kind;
+    bptree->buffered++;
+    if (i + 1 >= bptree->buffer_messages) {
+        buffer_empty(bptree, root);
+    }
+}
+
+static void buffer_flush_subtree(BPTree* bptree, BPNode* node) {
+    if (node->type == LEAF) {
+        return;
+    }
+    buffer_empty(bptree, node);
+    for (int i = 0; i <= node->nkeys; i++) {
+        buffer_flush_subtree(bptree, node_children(node)[i]);
+    }
+}
+
+// Apply every buffered message to the leaves. Passes over the tree
+// repeat until none is left, since splits can move messages into nodes
+// a pass has gone by.
+void bptree_flush_buffers(BPTree* bptree) {
+    while (bptree->buffered > 0) {
+        buffer_flush_subtree(bptree, bptree->root);
+    }
+}
+
+// Buffer up to messages inserts and deletes in each internal node (0
+// for none); see buffer_empty. Internal nodes grow by the buffer, so
+// a larger one can only be set while the tree has no internal nodes:
+// when it is empty or about to be bulk loaded. Returns false, after
+// saying why, if it has some. Scans, seeks, batched searches, merges
+// and saves flush the buffers first. The concurrent calls don't know
+// about them: flush (or set 0) before using those.
+bool bptree_set_insert_buffers(BPTree* bptree, int messages) {
+    messages = messages < 0 ? 0 : messages;
+    if (messages > MAX_BUFFER_MESSAGES) {
+        printf("Insert buffers hold at most %d messages\n", MAX_BUFFER_MESSAGES);
+        return false;
+    }
+    ArenaPool* pool = &bptree->arena.pools[INTERNAL];
+    if (messages > 0 && bptree->snapshot_slots != NULL) {
+        printf("Insert buffers don't work with snapshots\n");
+        return false;
+    }
+    size_t node_bytes = ROUND_TO_LINE(buffer_node_bytes(bptree->key_slots, 2 * messages));
+    if (messages > 0 && node_bytes > pool->node_bytes) {
+        if (bptree->root != NULL && (bptree->root->type != LEAF || bptree->pool != NULL)) {
+            printf("Insert buffers have to be set before the tree has internal nodes\n");
+            return false;
+        }
+        pool->node_bytes = node_bytes;
+        pool->free_list = NULL;
+    }
+    bptree_flush_buffers(bptree);
+    bptree->buffer_messages = messages;
+    return true;
+}
+
+// Snapshots (bptree_set_snapshots): readers take an immutable view of
+// the tree and read it while a writer goes on changing the tree. The
+// writer never changes a node a snapshot can reach. It copies the leaf
+// it writes to and every node above it (path copying), and publishes the
+// copied root with one atomic store; the rest of the tree is shared
+// between versions. A snapshot is a root pointer, and nothing under it
+// changes, so readers never block or retry.
+//
+// Copies can't keep the leaf chain right for old versions: the leaf
+// before a copied one would have to be copied too, and the one before
+// that. So next belongs to the live tree only. The writer repoints the
+// previous leaf at the copy in place, snapshot readers never follow
+// next, and snapshot_scan climbs its path to the next leaf instead.
+//
+// Replaced nodes are retired rather than freed, since readers may still
+// be in them, and freed by epoch: each write advances the tree's epoch
+// and tags what it replaced with the old one. A reader announces the
+// epoch it starts in before it loads the root, and nodes are freed once
+// every announced epoch is newer than theirs. A writer never waits for
+// a reader; a long scan only keeps the nodes it might read a while
+// longer.
+//
+// In snapshot mode only bptree_insert and bptree_delete write, from one
+// thread at a time, and deletes don't rebalance: like buffered deletes,
+// they can leave underfull leaves until the next bulk load. Bulk loads,
+// merges and the concurrent calls still change nodes in place, so they
+// need every snapshot released first.
+#define SNAPSHOT_RECLAIM_NODES 256  // Retired nodes between reclaims
+
+typedef struct Snapshot {
+    BPTree* bptree;
+    BPNode* root;
+    int slot;
+} Snapshot;
+
+static BPNode* node_copy(BPTree* bptree, BPNode* node) {
+    BPNode* copy = node_new(bptree, node->type);
+    memcpy(copy, node, bptree->arena.pools[node->type].node_bytes);
+    atomic_store_explicit(&copy->version, 0, memory_order_relaxed);
+    return copy;
+}
+
+static void snapshot_retire(BPTree* bptree, BPNode* node, uint64_t epoch) {
+    RetiredNodes* retired = &bptree->retired;
+    if (retired->count == retired->capacity) {
+        retired->capacity = retired->capacity == 0 ? 256 : 2 * retired->capacity;
+        retired->nodes = (BPNode**)realloc(retired->nodes, sizeof(BPNode*) * retired->capacity);
+        retired->epochs = (uint64_t*)realloc(retired->epochs, sizeof(uint64_t) * retired->capacity);
+        if (retired->nodes == NULL || retired->epochs == NULL) {
+            printf("Failed to allocate retired node list\n");
+            exit(1);
+        }
+    }
+    retired->nodes[retired->count] = node;
+    retired->epochs[retired->count++] = epoch;
+}
+
+// Free the retired nodes older than every open snapshot.
+static void snapshot_reclaim(BPTree* bptree) {
+    uint64_t oldest = UINT64_MAX;
+    for (int s = 0; s < SNAPSHOT_SLOTS; s++) {
+        uint64_t epoch = __atomic_load_n(&bptree->snapshot_slots[s].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    RetiredNodes* retired = &bptree->retired;
+    long kept = 0;
+    for (long i = 0; i < retired->count; i++) {
+        if (retired->epochs[i] < oldest) {
+            node_free(bptree, retired->nodes[i]);
+        } else {
+            retired->nodes[kept] = retired->nodes[i];
+            retired->epochs[kept++] = retired->epochs[i];
+        }
+    }
+    retired->count = kept;
+    retired->reclaim_at = kept + SNAPSHOT_RECLAIM_NODES;
+}
+
+// Finish a write: leaf, at the end of path (the nodes above it, and the
+// child taken in each), was replaced by copy, split if it overflowed.
+// Copy the path above it, publish the new root and retire the old path.
+static void snapshot_publish(BPTree* bptree, BPNode** path, int* slots, int depth,
+                             BPNode* leaf, BPNode* copy, Split split) {
+    // The leaf before it in the chain is the rightmost one left of the
+    // path, under the lowest node where the path didn't take child 0.
+    int d = depth - 1;
+    while (d >= 0 && slots[d] == 0) {
+        d--;
+    }
+    if (d >= 0) {
+        BPNode* prev = node_children(path[d])[slots[d] - 1];
+        while (prev->type != LEAF) {
+            prev = node_children(prev)[prev->nkeys];
+        }
+        prev->next = copy;
+    }
+
+    BPNode* child = copy;
+    for (d = depth - 1; d >= 0; d--) {
+        BPNode* node = node_copy(bptree, path[d]);
+        node_children(node)[slots[d]] = child;
+        if (split.right != NULL) {
+            node_insert_entry(bptree, node, split.key, split.right);
+            split.right = NULL;
+            if (node->nkeys > bptree->max_keys) {
+                split = node_split(bptree, node);
+            }
+        }
+        child = node;
+    }
+    if (split.right != NULL) {
+        BPNode* root = node_new(bptree, INTERNAL);
+        node_children(root)[0] = child;
+        node_insert_entry(bptree, root, split.key, split.right);
+        child = root;
+    }
+
+    // Readers that load the new root announced a newer epoch than the
+    // one the old path is tagged with.
+    uint64_t epoch = bptree->epoch;
+    __atomic_store_n(&bptree->root, child, __ATOMIC_SEQ_CST);
+    snapshot_retire(bptree, leaf, epoch);
+    for (d = 0; d < depth; d++) {
+        snapshot_retire(bptree, path[d], epoch);
+    }
+    __atomic_store_n(&bptree->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    tree_shape_changed(bptree, 0);
+    if (bptree->retired.count >= bptree->retired.reclaim_at) {
+        snapshot_reclaim(bptree);
+    }
+}
+
+static void snapshot_insert(BPTree* bptree, bpkey_t key, bpval_t value) {
+    BPNode* path[100];
+    int slots[100];
+    int depth = 0;
+    BPNode* node = bptree->root;
+    while (node->type != LEAF) {
+        int i = node_upper_bound(bptree, node, key);
+        path[depth] = node;
+        slots[depth++] = i;
+        node = node_children(node)[i];
+    }
+
+    BPNode* copy = node_copy(bptree, node);
+    Split split = {NULL, KEY_ZERO};
+    if (!leaf_has_room(bptree, copy, key, bptree->leaf_slots)) {
+        // A packed leaf too full to widen its format for key: the
+        // halves of a split both have room.
+        split = node_split(bptree, copy);
+        leaf_insert_entry(bptree, key_lt(key, split.key) ? copy : split.right, key, value);
+    } else {
+        leaf_insert_entry(bptree, copy, key, value);
+        if (copy->nkeys > node_max_keys(bptree, copy)) {
+            split = node_split(bptree, copy);
+        }
+    }
+    snapshot_publish(bptree, path, slots, depth, node, copy, split);
+}
+
+static bool snapshot_delete(BPTree* bptree, bpkey_t key) {
+    BPNode* path[100];
+    int slots[100];
+    int depth = 0;
+    BPNode* node = bptree->root;
+    while (node->type != LEAF) {
+        int i = node_upper_bound(bptree, node, key);
+        path[depth] = node;
+        slots[depth++] = i;
+        node = node_children(node)[i];
+    }
+
+    int i = leaf_upper_bound(bptree, node, key) - 1;
+    if (i < 0 || !key_eq(leaf_key(node, i), key)) {
+        return false;
+    }
+    BPNode* copy = node_copy(bptree, node);
+    node_remove_entry(copy, i);
+    leaf_model_shift(bptree, copy, i);
+    snapshot_publish(bptree, path, slots, depth, node, copy, (Split){NULL, KEY_ZERO});
+    return true;
+}
+
+// Turn snapshot mode on or off. Turning it off waits for the open
+// snapshots to be released, then frees the nodes they kept. It needs a
+// tree in memory, without insert buffers.
+bool bptree_set_snapshots(BPTree* bptree, bool on) {
+    if (on) {
+        if (bptree->snapshot_slots != NULL) {
+            return true;
+        }
+        if (bptree->map != NULL || bptree->pool != NULL || bptree->buffer_messages > 0) {
+            printf("Snapshots need a tree in memory without insert buffers\n");
+            return false;
+        }
+        if (posix_memalign((void**)&bptree->snapshot_slots, CACHE_LINE,
+                           sizeof(SnapshotSlot) * SNAPSHOT_SLOTS) != 0) {
+            printf("Failed to allocate snapshot slots\n");
+            exit(1);
+        }
+        memset(bptree->snapshot_slots, 0, sizeof(SnapshotSlot) * SNAPSHOT_SLOTS);
+        bptree->retired.reclaim_at = bptree->retired.count + SNAPSHOT_RECLAIM_NODES;
+        return true;
+    }
+
+    if (bptree->snapshot_slots == NULL) {
+        return true;
+    }
+    for (int s = 0; s < SNAPSHOT_SLOTS; s++) {
+        while (__atomic_load_n(&bptree->snapshot_slots[s].epoch, __ATOMIC_ACQUIRE) != 0) {
+            sched_yield();
+        }
+    }
+    snapshot_reclaim(bptree);
+    free(bptree->snapshot_slots);
+    bptree->snapshot_slots = NULL;
+    return true;
+}
+
+// Take a snapshot of the tree as it is now: it can be read, from any
+// thread, until snapshot_release, whatever the writer does meanwhile.
+// With SNAPSHOT_SLOTS snapshots open, this waits for one to be released.
+Snapshot bptree_snapshot(BPTree* bptree) {
+    SnapshotSlot* slots = bptree->snapshot_slots;
+    if (slots == NULL) {
+        printf("Snapshots have to be turned on first (bptree_set_snapshots)\n");
+        exit(1);
+    }
+    for (;;) {
+        for (int s = 0; s < SNAPSHOT_SLOTS; s++) {
+            uint64_t free_slot = 0;
+            uint64_t epoch = __atomic_load_n(&bptree->epoch, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&slots[s].epoch, __ATOMIC_RELAXED) == 0 &&
+                __atomic_compare_exchange_n(&slots[s].epoch, &free_slot, epoch, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                return (Snapshot){bptree, __atomic_load_n(&bptree->root, __ATOMIC_SEQ_CST), s};
+            }
+        }
+        sched_yield();
+    }
+}
+
+void snapshot_release(Snapshot* snapshot) {
+    __atomic_store_n(&snapshot->bptree->snapshot_slots[snapshot->slot].epoch, 0,
+                     __ATOMIC_RELEASE);
+    snapshot->root = NULL;
+}
+
+Search snapshot_search(const Snapshot* snapshot, bpkey_t key) {
+    BPTree* bptree = snapshot->bptree;
+    BPNode* node = snapshot->root;
+    while (node->type != LEAF) {
+        node = node_children(node)[node_upper_bound(bptree, node, key)];
+    }
+    return leaf_find(bptree, node, key);
+}
+
+// bptree_scan over a snapshot. It keeps the path to its leaf, and gets
+// to the next leaf by climbing to the lowest node with a child further
+// right and going down that child's leftmost path.
+int snapshot_scan(const Snapshot* snapshot, bpkey_t lo, bpkey_t hi, bpkey_t* out_keys,
+                  bpval_t* out_values, int max) {
+    BPTree* bptree = snapshot->bptree;
+    BPNode* path[100];
+    int slots[100];
+    int depth = 0;
+    BPNode* node = snapshot->root;
+    while (node->type != LEAF) {
+        int i = node_upper_bound(bptree, node, lo);
+        path[depth] = node;
+        slots[depth++] = i;
+        node = node_children(node)[i];
+    }
+
+    int i = 0;
+    while (i < node->nkeys && key_lt(leaf_key(node, i), lo)) {
+        i++;
+    }
+
+    int n = 0;
+    while (n < max) {
+        if (depth > 0 && slots[depth - 1] < path[depth - 1]->nkeys) {
+            leaf_prefetch(node_children(path[depth - 1])[slots[depth - 1] + 1], node->key_slots);
+        }
+        bpval_t* values = node_values(node);
+        for (; i < node->nkeys && n < max; i++) {
+            bpkey_t key = leaf_key(node, i);
+            if (key_lt(hi, key)) {
+                return n;
+            }
+            if (out_values != NULL) {
+                out_values[n] = values[i];
+            }
+            out_keys[n++] = key;
+        }
+
+        while (depth > 0 && slots[depth - 1] == path[depth - 1]->nkeys) {
+            depth--;
+        }
+        if (depth == 0) {
+            break;
+        }
+        node = node_children(path[depth - 1])[++slots[depth - 1]];
+        while (node->type != LEAF) {
+            path[depth] = node;
+            slots[depth++] = 0;
+            node = node_children(node)[0];
+        }
+        i = 0;
+    }
+
+    return n;
+}
+
+void print_tree(BPNode* root, int level);
+
+void bptree_insert(BPTree* bptree, bpkey_t key, bpval_t value) {
+    if (bptree->snapshot_slots != NULL) {
+        snapshot_insert(bptree, key, value);
+    } else if (bptree->buffer_messages > 0 && bptree->root->type != LEAF) {
+        buffer_write(bptree, key, value, MESSAGE_INSERT);
+    } else if (!append_insert(bptree, key, value)) {
+        node_insert(bptree, bptree->root, key, value);
+    }
+    top_index_maintain(bptree);
+    if (bptree->filter != NULL) {
+        filter_add(bptree->filter, key, false);
+        filter_maintain(bptree);
+    }
+}
+
+// Concurrent access with optimistic lock coupling.
+//
+// Each node's version is a counter with two flag bits: bit 1 is set while
+// a writer holds the node, bit 0 marks a node that was retired. A writer
+// locks by CAS from the version it read to version + 2, and unlocks by
+// adding 2 again, which clears the lock bit and bumps the counter.
+//
+// Readers never write to nodes. They note a node's version, read what they
+// need, and check the version again before trusting it (in particular,
+// before following a child pointer). If it changed, the operation starts
+// over from the root. Writers descend the same way and only lock the
+// leaf they insert into, or a node they split together with its parent.
+// Full nodes are split on the way down, so a parent always has room for
+// the separator.
+//
+// Only these two operations are safe to run concurrently; scans,
+// deletes and bulk loads need the tree to themselves.
+#define VERSION_OBSOLETE 1u
+#define VERSION_LOCKED 2u
+
+static inline void cpu_relax(void) {
+#ifdef BPTREE_X86
+    _mm_pause();
+#endif
+}
+
+static inline BPNode* root_load(BPTree* bptree) {
+    return __atomic_load_n(&bptree->root, __ATOMIC_ACQUIRE);
+}
+
+// Wait for the node to be unlocked and return its version.
+// Returns false if the node was retired.
+static inline bool node_read_lock(BPNode* node, uint32_t* version) {
+    uint32_t v = atomic_load_explicit(&node->version, memory_order_acquire);
+    for (int spins = 1; v & VERSION_LOCKED; spins++) {
+        if (spins % 128 == 0) {
+            sched_yield();
+        } else {
+            cpu_relax();
+        }
+        v = atomic_load_explicit(&node->version, memory_order_acquire);
+    }
+    *version = v;
+    return (v & VERSION_OBSOLETE) == 0;
+}
+
+// True if nothing changed the node since version was read.
+static inline bool node_validate(BPNode* node, uint32_t version) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&node->version, memory_order_relaxed) == version;
+}
+
+static inline bool node_upgrade_lock(BPNode* node, uint32_t version) {
+    return atomic_compare_exchange_strong_explicit(&node->version, &version,
+                                                   version + VERSION_LOCKED,
+                                                   memory_order_acquire,
+                                                   memory_order_relaxed);
+}
+
+static inline void node_write_unlock(BPNode* node) {
+    atomic_fetch_add_explicit(&node->version, VERSION_LOCKED, memory_order_release);
+}
+
+// True if key is in the tree; its value is stored in *value unless
+// value is NULL.
+bool bptree_search_olc(BPTree* bptree, bpkey_t key, bpval_t* value) {
+    if (bptree->filter != NULL && !filter_may_contain(bptree->filter, key)) {
+        return false;
+    }
+    for (;;) {
+        BPNode* node = root_load(bptree);
+        uint32_t version;
+        if (!node_read_lock(node, &version) || node != root_load(bptree)) {
+            continue;
+        }
+
+        bool restart = false;
+        while (node->type != LEAF) {
+            BPNode* child = node_child(bptree, node, node_upper_bound(bptree, node, key));
+            if (!node_validate(node, version)) {
+                restart = true;
+                break;
+            }
+            // Check the parent again once the child's version is known, so
+            // a split of the child in between can't go unnoticed.
+            uint32_t child_version;
+            if (!node_read_lock(child, &child_version) || !node_validate(node, version)) {
+                restart = true;
+                break;
+            }
+            node = child;
+            version = child_version;
+        }
+        if (restart) {
+            continue;
+        }
+
+        // Read the format and count once and keep them in bounds, since
+        // a writer may be repacking the leaf.
+        int format = node->format;
+        int n = node->nkeys;
+        if (format >= LEAF_FORMATS || n > bptree->leaf_slots[format]) {
+            continue;
+        }
+        int i = leaf_upper_bound_as(bptree, node, format, n, key) - 1;
+        bool found = i >= 0 && key_eq(leaf_key_as(node, format, i), key);
+        bpval_t* values = (bpval_t*)((char*)node +
+                                     leaf_values_offset(format, bptree->leaf_slots[format]));
+        bpval_t found_value = found ? values[i] : 0;
+        if (node_validate(node, version)) {
+            if (found && value != NULL) {
+                *value = found_value;
+            }
+            return found;
+        }
+    }
+}
+
+// Split a full node while holding it and its parent (NULL for the root).
+static void olc_split(BPTree* bptree, BPNode* parent, BPNode* node) {
+    pthread_mutex_lock(&bptree->arena_lock);
+    Split split = node_split(bptree, node);
+    BPNode* root = parent == NULL ? node_new(bptree, INTERNAL) : NULL;
+    pthread_mutex_unlock(&bptree->arena_lock);
+
+    if (parent != NULL) {
+        node_insert_entry(bptree, parent, split.key, split.right);
+    } else {
+        node_children(root)[0] = node;
+        node_insert_entry(bptree, root, split.key, split.right);
+        __atomic_store_n(&bptree->root, root, __ATOMIC_RELEASE);
+    }
+}
+
+// One attempt at an insert. Returns false if it has to start over.
+static bool olc_insert_attempt(BPTree* bptree, bpkey_t key, bpval_t value) {
+    BPNode* node = root_load(bptree);
+    uint32_t version;
+    if (!node_read_lock(node, &version) || node != root_load(bptree)) {
+        return false;
+    }
+    BPNode* parent = NULL;
+    uint32_t parent_version = 0;
+    int depth = 0;
+
+    for (;;) {
+        if (node->nkeys >= node_max_keys(bptree, node)) {
+            if (parent != NULL && !node_upgrade_lock(parent, parent_version)) {
+                return false;
+            }
+            if (!node_upgrade_lock(node, version)) {
+                if (parent != NULL) {
+                    node_write_unlock(parent);
+                }
+                return false;
+            }
+            if (parent == NULL && node != root_load(bptree)) {
+                node_write_unlock(node);
+                return false;
+            }
+
+            tree_shape_changed(bptree, depth);
+            olc_split(bptree, parent, node);
+
+            node_write_unlock(node);
+            if (parent != NULL) {
+                node_write_unlock(parent);
+            }
+            // The key goes in on a fresh descent through the split nodes.
+            return false;
+        }
+
+        if (node->type == LEAF) {
+            break;
+        }
+
+        if (parent != NULL && !node_validate(parent, parent_version)) {
+            return false;
+        }
+        BPNode* child = node_children(node)[node_upper_bound(bptree, node, key)];
+        if (!node_validate(node, version)) {
+            return false;
+        }
+        parent = node;
+        parent_version = version;
+        node = child;
+        depth++;
+        if (!node_read_lock(node, &version)) {
+            return false;
+        }
+    }
+
+    if (!node_upgrade_lock(node, version)) {
+        return false;
+    }
+    if (parent != NULL && !node_validate(parent, parent_version)) {
+        node_write_unlock(node);
+        return false;
+    }
+    if (!leaf_has_room(bptree, node, key, bptree->leaf_max_keys)) {
+        // A packed leaf that can't widen for key; split it like a full one.
+        if (parent != NULL && !node_upgrade_lock(parent, parent_version)) {
+            node_write_unlock(node);
+            return false;
+        }
+        if (parent == NULL && node != root_load(bptree)) {
+            node_write_unlock(node);
+            return false;
+        }
+        tree_shape_changed(bptree, depth);
+        olc_split(bptree, parent, node);
+        node_write_unlock(node);
+        if (parent != NULL) {
+            node_write_unlock(parent);
+        }
+        return false;
+    }
+    leaf_insert_entry(bptree, node, key, value);
+    node_write_unlock(node);
+    return true;
+}
+
+void bptree_insert_olc(BPTree* bptree, bpkey_t key, bpval_t value) {
+    // Before the key is in a leaf, so no search can find it and then
+    // be told it isn't there.
+    if (bptree->filter != NULL) {
+        filter_add(bptree->filter, key, true);
+    }
+    while (!olc_insert_attempt(bptree, key, value)) {
+    }
+}
+
+// Remove key i and its value, or for internal nodes, the child to
+// its right.
+void node_remove_entry(BPNode* node, int i) {
+    if (node->type == LEAF && node->format != KEYS_PLAIN) {
+        // The base stays, so the other offsets still hold.
+        int width = format_delta_bytes(node->format);
+        char* deltas = (char*)leaf_deltas(node);
+        bpval_t* values = node_values(node);
+        memmove(deltas + i * width, deltas + (i + 1) * width, (size_t)(node->nkeys - 1 - i) * width);
+        memmove(values + i, values + i + 1, sizeof(bpval_t) * (node->nkeys - 1 - i));
+        node->nkeys--;
+        return;
+    }
+
+    for (int j = i; j < node->nkeys - 1; j++) {
+        node->keys[j] = node->keys[j + 1];
+    }
+    if (node->type == INTERNAL) {
+        BPNode** children = node_children(node);
+        for (int j = i + 1; j < node->nkeys; j++) {
+            children[j] = children[j + 1];
+        }
+        children[node->nkeys] = NULL;
+    } else {
+        bpval_t* values = node_values(node);
+        for (int j = i; j < node->nkeys - 1; j++) {
+            values[j] = values[j + 1];
+        }
+    }
+    node->nkeys--;
+    node->keys[node->nkeys] = KEY_ZERO;
+}
+
+static inline bool leaves_packed(BPNode* a, BPNode* b) {
+    return a->type == LEAF && (a->format != KEYS_PLAIN || b->format != KEYS_PLAIN);
+}
+
+// Move one entry from a sibling into node, which has just underflowed.
+// The separator in the parent rotates through so it stays valid.
+void node_borrow_left(BPTree* bptree, BPNode* parent, int idx, BPNode* node, BPNode* left) {
+    if (leaves_packed(node, left)) {
+        leaf_rebalance(bptree, left, node, left->nkeys - 1);
+        parent->keys[idx - 1] = leaf_key(node, 0);
+        return;
+    }
+
+    for (int j = node->nkeys; j > 0; j--) {
+        node->keys[j] = node->keys[j - 1];
+    }
+
+    if (node->type == LEAF) {
+        bpval_t* values = node_values(node);
+        for (int j = node->nkeys; j > 0; j--) {
+            values[j] = values[j - 1];
+        }
+        node->keys[0] = left->keys[left->nkeys - 1];
+        values[0] = node_values(left)[left->nkeys - 1];
+        parent->keys[idx - 1] = node->keys[0];
+        leaf_model_shift(bptree, node, 0);
+    } else {
+        BPNode** children = node_children(node);
+        BPNode** left_children = node_children(left);
+        for (int j = node->nkeys + 1; j > 0; j--) {
+            children[j] = children[j - 1];
+        }
+        node->keys[0] = parent->keys[idx - 1];
+        children[0] = left_children[left->nkeys];
+        left_children[left->nkeys] = NULL;
+        parent->keys[idx - 1] = left->keys[left->nkeys - 1];
+    }
+    node->nkeys++;
+
+    left->nkeys--;
+    left->keys[left->nkeys] = KEY_ZERO;
+}
+
+void node_borrow_right(BPTree* bptree, BPNode* parent, int idx, BPNode* node, BPNode* right) {
+    if (leaves_packed(node, right)) {
+        leaf_rebalance(bptree, node, right, node->nkeys + 1);
+        parent->keys[idx] = leaf_key(right, 0);
+        return;
+    }
+
+    if (node->type == LEAF) {
+        bpval_t* right_values = node_values(right);
+        node->keys[node->nkeys] = right->keys[0];
+        node_values(node)[node->nkeys] = right_values[0];
+        parent->keys[idx] = right->keys[1];
+        for (int j = 0; j < right->nkeys - 1; j++) {
+            right_values[j] = right_values[j + 1];
+        }
+    } else {
+        BPNode** right_children = node_children(right);
+        node->keys[node->nkeys] = parent->keys[idx];
+        node_children(node)[node->nkeys + 1] = right_children[0];
+        parent->keys[idx] = right->keys[0];
+        for (int j = 0; j < right->nkeys; j++) {
+            right_children[j] = right_children[j + 1];
+        }
+        right_children[right->nkeys] = NULL;
+    }
+    node->nkeys++;
+
+    for (int j = 0; j < right->nkeys - 1; j++) {
+        right->keys[j] = right->keys[j + 1];
+    }
+    right->nkeys--;
+    right->keys[right->nkeys] = KEY_ZERO;
+    if (right->type == LEAF) {
+        leaf_model_shift(bptree, right, 0);
+    }
+}
+
+// Fold right into left, its neighbor under parent->keys[idx],
+// then drop that separator and free right.
+void node_merge(BPTree* bptree, BPNode* parent, int idx, BPNode* left, BPNode* right) {
+    if (leaves_packed(left, right)) {
+        leaf_rebalance(bptree, left, right, left->nkeys + right->nkeys);
+        left->next = right->next;
+        node_remove_entry(parent, idx);
+        node_free(bptree, right);
+        return;
+    }
+
+    if (left->type == INTERNAL) {
+        left->keys[left->nkeys++] = parent->keys[idx];
+    }
+
+    int base = left->nkeys;
+    for (int j = 0; j < right->nkeys; j++) {
+        left->keys[base + j] = right->keys[j];
+    }
+
+    if (left->type == INTERNAL) {
+        BPNode** left_children = node_children(left);
+        BPNode** right_children = node_children(right);
+        for (int j = 0; j <= right->nkeys; j++) {
+            left_children[base + j] = right_children[j];
+        }
+    } else {
+        memcpy(node_values(left) + base, node_values(right), sizeof(bpval_t) * right->nkeys);
+        left->next = right->next;
+    }
+    left->nkeys += right->nkeys;
+    if (left->type == LEAF) {
+        leaf_model_fit(bptree, left);
+    }
+
+    node_remove_entry(parent, idx);
+    node_free(bptree, right);
+}
+
+// Remove key from the tree. Returns false if it wasn't there.
+//
+// Like node_insert, the path is kept on a stack. Any node (other than
+// the root) left with fewer than order keys borrows from a sibling that
+// can spare one, or else merges with it, which may underflow the parent.
+static bool node_delete(BPTree* bptree, bpkey_t key) {
+    BPNode* stack[100];
+    int slots[100];
+    int top = 0;
+
+    BPNode* node = bptree->root;
+    while (node->type != LEAF) {
+        int i = node_upper_bound(bptree, node, key);
+        stack[top] = node;
+        slots[top++] = i;
+        node = node_children(node)[i];
+    }
+
+    int i = leaf_upper_bound(bptree, node, key) - 1;
+    if (i < 0 || !key_eq(leaf_key(node, i), key)) {
+        return false;
+    }
+    node_remove_entry(node, i);
+    leaf_model_shift(bptree, node, i);
+
+    while (top > 0 && node->nkeys < bptree->order) {
+        BPNode* parent = stack[--top];
+        int idx = slots[top];
+        tree_shape_changed(bptree, top + 1);
+        BPNode* left = idx > 0 ? node_children(parent)[idx - 1] : NULL;
+        BPNode* right = idx < parent->nkeys ? node_children(parent)[idx + 1] : NULL;
+
+        if (left != NULL && left->nkeys > bptree->order) {
+            node_borrow_left(bptree, parent, idx, node, left);
+            return true;
+        }
+        if (right != NULL && right->nkeys > bptree->order) {
+            node_borrow_right(bptree, parent, idx, node, right);
+            return true;
+        }
+
+        if (left != NULL) {
+            node_merge(bptree, parent, idx - 1, left, node);
+        } else {
+            node_merge(bptree, parent, idx, node, right);
+        }
+        node = parent;
+    }
+
+    BPNode* root = bptree->root;
+    if (root->type == INTERNAL && root->nkeys == 0) {
+        bptree->root = node_children(root)[0];
+        node_free(bptree, root);
+    }
+
+    return true;
+}
+
+bool bptree_delete(BPTree* bptree, bpkey_t key) {
+    if (bptree->snapshot_slots != NULL) {
+        if (!snapshot_delete(bptree, key)) {
+            return false;
+        }
+    } else if (bptree->buffer_messages > 0 && bptree->root->type != LEAF) {
+        // Whether it is there decides the result, so look first.
+        if (bptree_search(bptree, key).node == NULL) {
+            return false;
+        }
+        buffer_write(bptree, key, 0, MESSAGE_DELETE);
+    } else if (!node_delete(bptree, key)) {
+        return false;
+    }
+    top_index_maintain(bptree);
+    if (bptree->filter != NULL) {
+        bptree->filter->stale++;
+        filter_maintain(bptree);
+    }
+    return true;
+}
+
+void print_tree(BPNode* root, int level) {
+    if (root == NULL) return;
+    
+    for (int i = 0; i < level; i++) {
+        printf("    ");  // 4 spaces for each level
+    }
+    
+    if (root->type == LEAF) {
+        static const char* formats[] = {"", "(16-bit) ", "(8-bit) "};
+        printf("Leaf %s[ ", formats[root->format]);
+    } else {
+        printf("Internal [ ");
+    }
+    
+    for (int i = 0; i < root->nkeys; i++) {
+        key_print(root->type == LEAF ? leaf_key(root, i) : root->keys[i]);
+        printf(" ");
+    }
+    printf("]");
+    
+    if (root->type == LEAF && root->next != NULL) {
+        printf(" -> next");
+    }
+    printf("\n");
+    
+    if (root->type != LEAF) {
+        for (int i = 0; i <= root->nkeys; i++) {
+            print_tree(node_children(root)[i], level + 1);
+        }
+    }
+}
+
+void search_and_print(BPTree* bptree, int key) {
+    printf("\nSearching for %d:\n", key);
+
+    Search result = bptree_search(bptree, key_from_long(key));
+
+    if (result.index == -1) {
+        printf("Key %d not found in the tree\n", key);
+        return;
+    }
+
+    printf("Found key %d (value %llu) at index %d in leaf node with keys:\n  ",
+           key, (unsigned long long)result.value, result.index);
     for (int i = 0; i < result.node->nkeys; i++) {
-        printf("%d ", result.node->keys[i]);
+        key_print(leaf_key(result.node, i));
+        printf(" ");
+    }
+    printf("\n");
+}
+
+// Bottom-up bulk loading from sorted keys.
+//
+// Each level is built straight from the one below it: the leaves from
+// the keys and values, then each internal level from the nodes under it, until a
+// level has a single node, which becomes the root. Nodes on a level are
+// given equal shares of the level below, sized so they are filled to
+// about fill * max_keys (but never under order keys). Leaving room means
+// the first inserts after a load don't split right away.
+//
+// Packed leaves hold as many keys as their format allows, so with
+// pack_leaves the leaf boundaries are planned first (plan_packed_leaves).
+//
+// A level is cut into contiguous runs of nodes, one per thread. Each
+// thread allocates from its own arena, which is handed to the tree
+// afterwards, and only the links between runs are made after the join.
+typedef struct LevelBuilder {
+    BPTree* bptree;
+    Arena arena;
+    const bpkey_t* keys;     // Leaf level: the sorted input
+    const bpval_t* values;   // Their values, or NULL for input positions
+    BPNode** children;       // Internal levels: the level below
+    const bpkey_t* child_lows;  // Smallest key under each child
+    long items;              // Keys or children to distribute
+    const long* bounds;      // Planned leaf starts, or NULL for equal shares
+    long nodes_total;        // Nodes on this level
+    long first;              // This builder's nodes: [first, last)
+    long last;
+    BPNode** nodes;          // Output
+    bpkey_t* lows;           // Output: smallest key under each node
+    pthread_t thread;
+} LevelBuilder;
+
+static void* level_build(void* arg) {
+    LevelBuilder* b = (LevelBuilder*)arg;
+    int key_slots = b->bptree->key_slots;
+
+    for (long i = b->first; i < b->last; i++) {
+        long start = i * b->items / b->nodes_total;
+        long end = (i + 1) * b->items / b->nodes_total;
+        if (b->bounds != NULL) {
+            start = b->bounds[i];
+            end = b->bounds[i + 1];
+        }
+        int count = (int)(end - start);
+        BPNode* node;
+
+        if (b->children == NULL) {
+            node = arena_node_new(&b->arena, LEAF, key_slots);
+            leaf_pack_keys(b->bptree, node, b->keys + start, count);
+            bpval_t* values = node_values(node);
+            if (b->values != NULL) {
+                memcpy(values, b->values + start, sizeof(bpval_t) * count);
+            } else {
+                for (int j = 0; j < count; j++) {
+                    values[j] = (bpval_t)(start + j);
+                }
+            }
+            b->lows[i] = count > 0 ? b->keys[start] : KEY_ZERO;
+            if (i > b->first) {
+                b->nodes[i - 1]->next = node;
+            }
+        } else {
+            node = arena_node_new(&b->arena, INTERNAL, key_slots);
+            BPNode** children = node_children(node);
+            for (int j = 0; j < count; j++) {
+                children[j] = b->children[start + j];
+                if (j > 0) {
+                    node->keys[j - 1] = b->child_lows[start + j];
+                }
+            }
+            node->nkeys = count - 1;
+            b->lows[i] = b->child_lows[start];
+        }
+        b->nodes[i] = node;
+    }
+    return NULL;
+}
+
+// How many nodes to spread items over: per_node each if possible, but
+// no fewer than min_per_node in any of them.
+static long level_node_count(long items, long per_node, long min_per_node) {
+    long count = (items + per_node - 1) / per_node;
+    long most = items / min_per_node;
+    if (count > most) {
+        count = most;
+    }
+    return count < 1 ? 1 : count;
+}
+
+// Where each packed leaf starts: about fill * the leaf's max keys each,
+// in the narrowest format their range allows, and never leaving fewer
+// than order keys for the last leaf. Returns the number of leaves;
+// bounds[leaves] is n.
+static long plan_packed_leaves(BPTree* bptree, const bpkey_t* keys, long n, double fill,
+                               long* bounds) {
+    long leaves = 0;
+    long start = 0;
+    do {
+        long remaining = n - start;
+        long count = 0;
+        for (int format = KEYS_FOR8; format >= KEYS_PLAIN; format--) {
+            int max_keys = bptree->leaf_max_keys[format];
+            if (max_keys == 0) {
+                continue;
+            }
+            long target = (long)(fill * max_keys + 0.5);
+            if (target < bptree->order) {
+                target = bptree->order;
+            }
+            count = remaining < target ? remaining : target;
+            if (remaining - count > 0 && remaining - count < bptree->order) {
+                count = remaining <= max_keys ? remaining : remaining - bptree->order;
+            }
+            uint64_t span;
+            if (format == KEYS_PLAIN || count == 0 ||
+                (key_delta(keys[start], keys[start + count - 1], &span) &&
+                 span <= format_max_delta(format))) {
+                break;
+            }
+        }
+        bounds[leaves++] = start;
+        start += count;
+    } while (start < n);
+    bounds[leaves] = n;
+    return leaves;
+}
+
+static void build_level(BPTree* bptree, LevelBuilder* builders, int threads,
+                        const bpkey_t* keys, const bpval_t* values, const long* bounds,
+                        BPNode** children, const bpkey_t* child_lows, long items,
+                        long nodes_total, BPNode** nodes, bpkey_t* lows) {
+    // Small levels aren't worth a thread each.
+    long per_thread_min = 1024;
+    if (threads > 1 && nodes_total / threads < per_thread_min) {
+        threads = (int)(nodes_total / per_thread_min);
+        if (threads < 1) {
+            threads = 1;
+        }
+    }
+
+    for (int t = 0; t < threads; t++) {
+        LevelBuilder* b = &builders[t];
+        b->bptree = bptree;
+        b->keys = keys;
+        b->values = values;
+        b->bounds = bounds;
+        b->children = children;
+        b->child_lows = child_lows;
+        b->items = items;
+        b->nodes_total = nodes_total;
+        b->first = t * nodes_total / threads;
+        b->last = (t + 1) * nodes_total / threads;
+        b->nodes = nodes;
+        b->lows = lows;
+    }
+
+    if (threads == 1) {
+        level_build(&builders[0]);
+    } else {
+        for (int t = 0; t < threads; t++) {
+            pthread_create(&builders[t].thread, NULL, level_build, &builders[t]);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(builders[t].thread, NULL);
+        }
+    }
+
+    // Stitch the leaf chain together across the runs.
+    if (children == NULL) {
+        for (int t = 1; t < threads; t++) {
+            if (builders[t].first > 0 && builders[t].first < builders[t].last) {
+                nodes[builders[t].first - 1]->next = nodes[builders[t].first];
+            }
+        }
+    }
+}
+
+// Replaces the contents of the tree with the sorted keys; the old
+// nodes are released. Each key gets the value at the same position in
+// values, or its position in keys if values is NULL. fill is clamped
+// to [0.5, 1]. threads <= 0 uses every online CPU.
+void bptree_bulk_load(BPTree* bptree, const bpkey_t* keys, const bpval_t* values, long n,
+                      double fill, int threads) {
+    bptree_destroy(bptree);
+
+    if (fill > 1.0) {
+        fill = 1.0;
+    }
+    if (fill < 0.5) {
+        fill = 0.5;
+    }
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    long per_node = (long)(fill * bptree->max_keys + 0.5);
+    if (per_node < bptree->order) {
+        per_node = bptree->order;
+    }
+
+    LevelBuilder* builders = (LevelBuilder*)malloc(sizeof(LevelBuilder) * threads);
+    for (int t = 0; t < threads; t++) {
+        arena_init(&builders[t].arena, bptree->arena.pools[LEAF].node_bytes,
+                   bptree->arena.pools[INTERNAL].node_bytes);
+        builders[t].arena.huge_pages = bptree->arena.huge_pages;
+    }
+
+    long count;
+    long* bounds = NULL;
+    if (bptree->pack_leaves) {
+        bounds = (long*)malloc(sizeof(long) * (n / bptree->order + 2));
+        count = plan_packed_leaves(bptree, keys, n, fill, bounds);
+    } else {
+        count = level_node_count(n, per_node, bptree->order);
+    }
+    BPNode** nodes = (BPNode**)malloc(sizeof(BPNode*) * count);
+    bpkey_t* lows = (bpkey_t*)malloc(sizeof(bpkey_t) * count);
+    build_level(bptree, builders, threads, keys, values, bounds, NULL, NULL, n, count, nodes,
+                lows);
+    free(bounds);
+
+    while (count > 1) {
+        long parents = level_node_count(count, per_node + 1, bptree->order + 1);
+        BPNode** parent_nodes = (BPNode**)malloc(sizeof(BPNode*) * parents);
+        bpkey_t* parent_lows = (bpkey_t*)malloc(sizeof(bpkey_t) * parents);
+        build_level(bptree, builders, threads, NULL, NULL, NULL, nodes, lows, count, parents,
+                    parent_nodes, parent_lows);
+        free(nodes);
+        free(lows);
+        nodes = parent_nodes;
+        lows = parent_lows;
+        count = parents;
+    }
+
+    bptree->root = nodes[0];
+    free(nodes);
+    free(lows);
+
+    for (int t = 0; t < threads; t++) {
+        arena_adopt(&bptree->arena, &builders[t].arena);
+    }
+    free(builders);
+    if (bptree->filter_bits > 0) {
+        filter_build(bptree);
+    }
+    if (bptree->top_levels > 0) {
+        top_index_build(bptree);
+    }
+}
+
+// Single-threaded load with full nodes.
+void bptree_bulk_insert(BPTree* bptree, const bpkey_t* keys, const bpval_t* values, int n) {
+    bptree_bulk_load(bptree, keys, values, n, 1.0, 1);
+}
+
+// Merging a sorted batch into a tree that already has keys.
+//
+// One walk down the tree hands each child the part of the batch under
+// it, found by a binary search of the batch per separator. A leaf is
+// merged with its part in one pass and cut into as many leaves as the
+// entries need, the first of them in the old leaf's place, so its
+// parent and the leaf before it still point to the right node. A node
+// whose children multiplied is cut up the same way, and the nodes it
+// turns into go up to its parent together, instead of one split at a
+// time. Only the parents of merged nodes are rewritten.
+//
+// When a child's part of the batch has at least as many keys as its
+// subtree, the subtree is rebuilt bottom-up from the merged entries
+// instead, like a bulk load, as long as that fills its top node. Whether
+// it does is found by counting the subtree's leaves, stopping as soon
+// as they hold more.
+typedef struct MergeBatch {
+    const bpkey_t* keys;
+    const bpval_t* values;  // Or NULL: a key's value is its position
+} MergeBatch;
+
+static inline bpval_t batch_value(const MergeBatch* batch, long i) {
+    return batch->values != NULL ? batch->values[i] : (bpval_t)i;
+}
+
+// The first of keys[lo, hi) that is >= key, or hi.
+static long batch_lower_bound(const bpkey_t* keys, long lo, long hi, bpkey_t key) {
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (key_lt(keys[mid], key)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Merge the n entries in keys/values with batch entries [lo, hi) into
+// out_keys/out_values. Batch keys go after equal keys already there,
+// like bptree_insert.
+static void merge_entries(const bpkey_t* keys, const bpval_t* values, long n,
+                          const MergeBatch* batch, long lo, long hi,
+                          bpkey_t* out_keys, bpval_t* out_values) {
+    long i = 0;
+    long out = 0;
+    while (i < n || lo < hi) {
+        if (lo == hi || (i < n && !key_lt(batch->keys[lo], keys[i]))) {
+            out_keys[out] = keys[i];
+            out_values[out++] = values[i++];
+        } else {
+            out_keys[out] = batch->keys[lo];
+            out_values[out++] = batch_value(batch, lo++);
+        }
+    }
+}
+
+// Cut m sorted entries into full leaves (packed ones if pack_leaves),
+// appending them to out. first is reused as the first leaf, and the
+// last links to where first linked.
+static void merge_fill_leaves(BPTree* bptree, BPNode* first, const bpkey_t* keys,
+                              const bpval_t* values, long m, NodeRun* out) {
+    long* bounds = (long*)malloc(sizeof(long) * (m / bptree->order + 2));
+    long count;
+    if (bptree->pack_leaves) {
+        count = plan_packed_leaves(bptree, keys, m, 1.0, bounds);
+    } else {
+        count = level_node_count(m, bptree->max_keys, bptree->order);
+        for (long i = 0; i <= count; i++) {
+            bounds[i] = i * m / count;
+        }
+    }
+
+    BPNode* tail = first->next;
+    BPNode* leaf = first;
+    for (long i = 0; i < count; i++) {
+        if (i > 0) {
+            BPNode* next = node_new(bptree, LEAF);
+            leaf->next = next;
+            leaf = next;
+        }
+        leaf_pack(bptree, leaf, keys + bounds[i], values + bounds[i], (int)(bounds[i + 1] - bounds[i]));
+        run_push(out, leaf, keys[bounds[i]]);
+    }
+    leaf->next = tail;
+    free(bounds);
+}
+
+// Spread the nodes of kids, with kids->lows[1..] as the separators
+// between them, over as few internal nodes as hold them, appending
+// those to out. first, if not NULL, is reused as the first node.
+static void merge_fill_internal(BPTree* bptree, BPNode* first, const NodeRun* kids, NodeRun* out) {
+    long count = level_node_count(kids->count, bptree->max_keys + 1, bptree->order + 1);
+    for (long i = 0; i < count; i++) {
+        long start = i * kids->count / count;
+        long end = (i + 1) * kids->count / count;
+        BPNode* node = i == 0 && first != NULL ? first : node_new(bptree, INTERNAL);
+        BPNode** children = node_children(node);
+        for (long j = start; j < end; j++) {
+            children[j - start] = kids->nodes[j];
+            if (j > start) {
+                node->keys[j - start - 1] = kids->lows[j];
+            }
+        }
+        node->nkeys = (int)(end - start - 1);
+        run_push(out, node, kids->lows[start]);
+    }
+}
+
+static void merge_leaf(BPTree* bptree, BPNode* leaf, const MergeBatch* batch, long lo, long hi,
+                       NodeRun* out) {
+    int n = leaf->nkeys;
+    long m = n + (hi - lo);
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * (n + m));
+    bpval_t* values = (bpval_t*)malloc(sizeof(bpval_t) * (n + m));
+    leaf_unpack(leaf, keys + m, values + m);
+    merge_entries(keys + m, values + m, n, batch, lo, hi, keys, values);
+    merge_fill_leaves(bptree, leaf, keys, values, m, out);
+    free(keys);
+    free(values);
+}
+
+// Free the nodes of a subtree, except keep.
+static void free_subtree(BPTree* bptree, BPNode* node, int height, BPNode* keep) {
+    if (height > 0) {
+        for (int i = 0; i <= node->nkeys; i++) {
+            free_subtree(bptree, node_children(node)[i], height - 1, keep);
+        }
+    }
+    if (node != keep) {
+        node_free(bptree, node);
+    }
+}
+
+// Replace a subtree with one built from its entries and batch [lo, hi),
+// given the subtree's leaves and entry count.
+static void merge_rebuild(BPTree* bptree, BPNode* node, int height, BPNode** leaves,
+                          long entries, const MergeBatch* batch, long lo, long hi,
+                          NodeRun* out) {
+    BPNode* first_leaf = leaves[0];
+    long m = entries + (hi - lo);
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * (entries + m));
+    bpval_t* values = (bpval_t*)malloc(sizeof(bpval_t) * (entries + m));
+    long k = m;
+    for (BPNode* leaf = first_leaf; ; leaf = leaf->next) {
+        leaf_unpack(leaf, keys + k, values + k);
+        k += leaf->nkeys;
+        if (leaf == leaves[1]) {
+            break;
+        }
+    }
+    BPNode* tail = leaves[1]->next;
+    merge_entries(keys + m, values + m, entries, batch, lo, hi, keys, values);
+
+    free_subtree(bptree, node, height, first_leaf);
+    first_leaf->next = tail;
+    NodeRun level = {0};
+    merge_fill_leaves(bptree, first_leaf, keys, values, m, &level);
+    free(keys);
+    free(values);
+    for (int h = 0; h < height; h++) {
+        NodeRun up = {0};
+        merge_fill_internal(bptree, NULL, &level, &up);
+        run_free(&level);
+        level = up;
+    }
+    for (long i = 0; i < level.count; i++) {
+        run_push(out, level.nodes[i], level.lows[i]);
+    }
+    run_free(&level);
+}
+
+// Entries in a subtree, or -1 once they are more than limit. Sets
+// leaves[0] and leaves[1] to its first and last leaf.
+static long subtree_entries(BPNode* node, int height, long limit, BPNode** leaves) {
+    BPNode* first = node;
+    BPNode* last = node;
+    for (int h = 0; h < height; h++) {
+        first = node_children(first)[0];
+        last = node_children(last)[last->nkeys];
+    }
+    leaves[0] = first;
+    leaves[1] = last;
+    long total = 0;
+    for (BPNode* leaf = first; ; leaf = leaf->next) {
+        total += leaf->nkeys;
+        if (total > limit) {
+            return -1;
+        }
+        if (leaf == last) {
+            return total;
+        }
+    }
+}
+
+// Whether m entries in full nodes make height levels of internal nodes
+// whose top node has at least order + 1 children, like any other node.
+static bool rebuild_fills_top(BPTree* bptree, int height, long m) {
+    long count = level_node_count(m, bptree->max_keys, bptree->order);
+    for (int h = 1; h < height; h++) {
+        count = level_node_count(count, bptree->max_keys + 1, bptree->order + 1);
+    }
+    return count >= bptree->order + 1;
+}
+
+// Merge batch [lo, hi) into the subtree under node, height levels above
+// the leaves, appending the nodes that take its place to out.
+static void merge_node(BPTree* bptree, BPNode* node, int height, const MergeBatch* batch,
+                       long lo, long hi, NodeRun* out) {
+    if (height == 0) {
+        merge_leaf(bptree, node, batch, lo, hi, out);
+        return;
+    }
+    BPNode* leaves[2];
+    long entries = subtree_entries(node, height, hi - lo, leaves);
+    if (entries >= 0 && rebuild_fills_top(bptree, height, entries + (hi - lo))) {
+        merge_rebuild(bptree, node, height, leaves, entries, batch, lo, hi, out);
+        return;
+    }
+
+    NodeRun kids = {0};
+    long start = lo;
+    for (int i = 0; i <= node->nkeys; i++) {
+        long end = i < node->nkeys ? batch_lower_bound(batch->keys, start, hi, node->keys[i]) : hi;
+        BPNode* child = node_children(node)[i];
+        long first = kids.count;
+        if (end > start) {
+            merge_node(bptree, child, height - 1, batch, start, end, &kids);
+        } else {
+            run_push(&kids, child, KEY_ZERO);
+        }
+        if (i > 0) {
+            kids.lows[first] = node->keys[i - 1];
+        }
+        start = end;
+    }
+    merge_fill_internal(bptree, node, &kids, out);
+    run_free(&kids);
+}
+
+int bptree_height(BPTree* bptree);
+
+// Add n sorted keys (with values, or their positions if values is NULL)
+// to a tree in memory, keeping what it has. Needs the tree to itself,
+// like bptree_bulk_load.
+void bptree_merge(BPTree* bptree, const bpkey_t* keys, const bpval_t* values, long n) {
+    if (n == 0) {
+        return;
+    }
+    bptree_flush_buffers(bptree);
+    MergeBatch batch = {keys, values};
+    NodeRun run = {0};
+    merge_node(bptree, bptree->root, bptree_height(bptree) - 1, &batch, 0, n, &run);
+    while (run.count > 1) {
+        NodeRun up = {0};
+        merge_fill_internal(bptree, NULL, &run, &up);
+        run_free(&run);
+        run = up;
+    }
+    bptree->root = run.nodes[0];
+    bptree->append_depth = 0;
+    run_free(&run);
+
+    if (bptree->filter != NULL && bptree->filter->keys + n > bptree->filter->capacity) {
+        filter_build(bptree);
+    } else if (bptree->filter != NULL) {
+        for (long i = 0; i < n; i++) {
+            filter_add(bptree->filter, keys[i], false);
+        }
+    }
+    if (bptree->top_levels > 0) {
+        top_index_build(bptree);
+    }
+}
+
+// Tree files (bptree_save/bptree_open): a header page, then every node
+// in breadth-first order, each in a record of its arena pool's node
+// size. The top levels end up together at the front of the file, and
+// every node is cache-line aligned in a mapping. Nodes are stored as
+// they are in memory, except that child and next references are file
+// offsets (a next of 0 ends the leaf chain). A file can only be opened
+// by a build with the same key type and node layout (and byte order).
+#define TREE_FILE_MAGIC "BPTREE3"
+#define TREE_FILE_HEADER_BYTES 4096
+
+typedef struct TreeFileHeader {
+    char magic[8];
+    char key_type[16];    // KEY_TYPE_NAME
+    uint32_t key_bytes;   // sizeof(bpkey_t)
+    int32_t order;
+    int32_t key_slots;
+    uint32_t node_bytes[ARENA_POOLS];  // Record size per NodeType
+    uint64_t root;        // Offset of the root node
+    uint64_t file_bytes;
+} TreeFileHeader;
+
+// Write the tree to path. Nothing may modify the tree meanwhile.
+// Returns false, after saying why, if the file can't be written.
+bool bptree_save(BPTree* bptree, const char* path) {
+    bptree_flush_buffers(bptree);
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        printf("Failed to create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    // Records have the standard node sizes even when the arena's nodes
+    // are bigger: internal nodes with insert buffers (flushed above)
+    // only have the empty buffers past them.
+    size_t record_bytes[ARENA_POOLS];
+    record_bytes[LEAF] = ROUND_TO_LINE(leaf_bytes(bptree->key_slots));
+    record_bytes[INTERNAL] = ROUND_TO_LINE(internal_bytes(bptree->key_slots, bptree->max_keys));
+    char* page = (char*)calloc(1, TREE_FILE_HEADER_BYTES);
+    char* record = (char*)malloc(record_bytes[LEAF] > record_bytes[INTERNAL] ? record_bytes[LEAF]
+                                                                              : record_bytes[INTERNAL]);
+    long capacity = 1024;
+    BPNode** queue = (BPNode**)malloc(sizeof(BPNode*) * capacity);
+    queue[0] = bptree->root;
+    long rear = 1;
+
+    // The header goes in last, once the file's size is known. Nodes are
+    // written in queue order, so a node's offset is known when it's queued.
+    bool ok = fwrite(page, TREE_FILE_HEADER_BYTES, 1, file) == 1;
+    uint64_t offset = TREE_FILE_HEADER_BYTES;
+    uint64_t next_offset = offset + record_bytes[bptree->root->type];
+
+    for (long head = 0; ok && head < rear; head++) {
+        BPNode* node = queue[head];
+        size_t bytes = record_bytes[node->type];
+        BPNode* copy = (BPNode*)record;
+        memcpy(copy, node, bytes);
+        atomic_store_explicit(&copy->version, 0, memory_order_relaxed);
+
+        if (node->type == LEAF) {
+            // Leaves are all on the last level, so the next one follows.
+            copy->next = node->next == NULL ? NULL : (BPNode*)(uintptr_t)(offset + bytes);
+        } else {
+            for (int i = 0; i <= node->nkeys; i++) {
+                if (rear == capacity) {
+                    capacity *= 2;
+                    queue = (BPNode**)realloc(queue, sizeof(BPNode*) * capacity);
+                }
+                BPNode* child = node_child(bptree, node, i);
+                queue[rear++] = child;
+                node_children(copy)[i] = (BPNode*)(uintptr_t)next_offset;
+                next_offset += record_bytes[child->type];
+            }
+        }
+
+        ok = fwrite(copy, bytes, 1, file) == 1;
+        offset += bytes;
+    }
+
+    TreeFileHeader* header = (TreeFileHeader*)page;
+    memcpy(header->magic, TREE_FILE_MAGIC, sizeof(header->magic));
+    strncpy(header->key_type, KEY_TYPE_NAME, sizeof(header->key_type) - 1);
+    header->key_bytes = sizeof(bpkey_t);
+    header->order = bptree->order;
+    header->key_slots = bptree->key_slots;
+    for (int i = 0; i < ARENA_POOLS; i++) {
+        header->node_bytes[i] = (uint32_t)record_bytes[i];
+    }
+    header->root = TREE_FILE_HEADER_BYTES;
+    header->file_bytes = offset;
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(page, TREE_FILE_HEADER_BYTES, 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        printf("Failed to write %s: %s\n", path, strerror(errno));
+    }
+
+    free(queue);
+    free(record);
+    free(page);
+    return ok;
+}
+
+// Why a mapped file can't be opened as a tree by this build, or NULL.
+static const char* tree_file_problem(const TreeFileHeader* header, size_t file_bytes) {
+    if (memcmp(header->magic, TREE_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        return "not a tree file";
+    }
+    if (header->key_bytes != sizeof(bpkey_t) ||
+        strncmp(header->key_type, KEY_TYPE_NAME, sizeof(header->key_type)) != 0) {
+        return "written with a different key type";
+    }
+    if (header->file_bytes != file_bytes || header->root >= file_bytes) {
+        return "truncated";
+    }
+    if (header->order < 1 || header->order > MAX_KEY_SLOTS / 2) {
+        return "written with a different node layout";
+    }
+    int key_slots = key_slots_for_order(header->order);
+    if (key_slots > MAX_KEY_SLOTS || header->key_slots != key_slots ||
+        header->node_bytes[LEAF] != ROUND_TO_LINE(leaf_bytes(key_slots)) ||
+        header->node_bytes[INTERNAL] != ROUND_TO_LINE(internal_bytes(key_slots, 2 * header->order))) {
+        return "written with a different node layout";
+    }
+    return NULL;
+}
+
+// Replace the tree with one saved by bptree_save. Nothing is read or
+// copied: the nodes are used in place from a read-only shared mapping,
+// so the file's pages load as searches touch them, and every process
+// that opens the file shares them in the page cache. The opened tree
+// serves searches (plain, batched and bptree_search_olc), seeks and
+// scans, but can't be modified; bptree_destroy or a bulk load replace
+// it like any other. Returns false, after saying why, if the file
+// can't be opened; the tree is left as it was.
+bool bptree_open(BPTree* bptree, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= TREE_FILE_HEADER_BYTES) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Failed to map %s\n", path);
+        return false;
+    }
+
+    const TreeFileHeader* header = (const TreeFileHeader*)map;
+    const char* problem = tree_file_problem(header, (size_t)st.st_size);
+    if (problem != NULL) {
+        printf("Failed to open %s: %s\n", path, problem);
+        munmap(map, (size_t)st.st_size);
+        return false;
+    }
+
+    // The order sets up the kernels and leaf formats; no nodes of our own.
+    bptree_destroy(bptree);
+    bptree_init_order(bptree, header->order);
+    arena_release(&bptree->arena);
+    bptree->map = map;
+    bptree->map_bytes = (size_t)st.st_size;
+    bptree->node_base = (uintptr_t)map;
+    bptree->root = (BPNode*)((char*)map + header->root);
+    return true;
+}
+
+// Read len bytes at offset, across short reads.
+static bool pread_all(int fd, void* buffer, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(fd, (char*)buffer + done, len - done, (off_t)(offset + done));
+        if (got <= 0) {
+            return false;
+        }
+        done += (size_t)got;
+    }
+    return true;
+}
+
+// Replace the tree with one saved by bptree_save, keeping about
+// cache_bytes of it in memory, for trees bigger than memory. Whole
+// levels from the top are pinned as long as they fit in half of
+// cache_bytes (the root level always is); the rest is the buffer pool
+// for the other nodes. Only bptree_search, bptree_scan and
+// bptree_height work on a paged tree, one thread at a time; the pool's
+// hits, misses and evictions are in bptree->pool. Returns false, after
+// saying why, if the file can't be opened; the tree is left as it was.
+bool bptree_open_paged(BPTree* bptree, const char* path, size_t cache_bytes) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    TreeFileHeader header;
+    memset(&header, 0, sizeof header);
+    const char* problem = "truncated";
+    if (fstat(fd, &st) == 0 && pread_all(fd, &header, sizeof(header), 0)) {
+        problem = tree_file_problem(&header, (size_t)st.st_size);
+    }
+
+    // Levels are stored one after another, so the nodes down the leftmost
+    // path mark where each level starts.
+    size_t page_bytes = header.node_bytes[LEAF] > header.node_bytes[INTERNAL]
+                            ? header.node_bytes[LEAF] : header.node_bytes[INTERNAL];
+    uint64_t starts[64];
+    int levels = 0;
+    if (problem == NULL) {
+        BPNode* node = (BPNode*)malloc(page_bytes);
+        uint64_t offset = header.root;
+        for (;;) {
+            if (levels == 63 || offset >= header.file_bytes ||
+                pread(fd, node, page_bytes, (off_t)offset) < (ssize_t)NODE_HEADER_BYTES) {
+                problem = "truncated";
+                break;
+            }
+            starts[levels++] = offset;
+            if (node->type == LEAF) {
+                break;
+            }
+            offset = (uint64_t)(uintptr_t)node_children(node)[0];
+        }
+        free(node);
+    }
+    if (problem != NULL) {
+        printf("Failed to open %s: %s\n", path, problem);
+        close(fd);
+        return false;
+    }
+    starts[levels] = header.file_bytes;
+
+    int pinned_levels = 1;
+    while (pinned_levels < levels - 1 && starts[pinned_levels + 1] - starts[0] <= cache_bytes / 2) {
+        pinned_levels++;
+    }
+    size_t pinned_bytes = starts[pinned_levels] - starts[0];
+    char* pinned = NULL;
+    if (posix_memalign((void**)&pinned, CACHE_LINE, pinned_bytes) != 0 ||
+        !pread_all(fd, pinned, pinned_bytes, starts[0])) {
+        printf("Failed to read %s: %s\n", path, strerror(errno));
+        free(pinned);
+        close(fd);
+        return false;
+    }
+    // Pool reads are point reads; the kernel's readahead would only
+    // bring in pages no one asked for.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+    BufferPool* pool = (BufferPool*)calloc(1, sizeof(BufferPool));
+    pool->fd = fd;
+    pool->pinned = pinned;
+    pool->pinned_start = starts[0];
+    pool->pinned_end = starts[pinned_levels];
+    pool->page_bytes = page_bytes;
+    size_t frames = cache_bytes > pinned_bytes ? (cache_bytes - pinned_bytes) / page_bytes : 0;
+    pool->frame_count = frames < 16 ? 16 : frames > (1 << 30) ? (1 << 30) : (int)frames;
+    if (posix_memalign((void**)&pool->frames, CACHE_LINE, (size_t)pool->frame_count * page_bytes) != 0) {
+        printf("Failed to allocate buffer pool\n");
+        exit(1);
+    }
+    pool->frame_slot = (int*)malloc(sizeof(int) * pool->frame_count);
+    memset(pool->frame_slot, 0xff, sizeof(int) * pool->frame_count);
+    int slot_bits = 1;
+    while ((1L << slot_bits) < 2L * pool->frame_count) {
+        slot_bits++;
+    }
+    pool->slot_shift = 64 - slot_bits;
+    pool->slot_mask = ((size_t)1 << slot_bits) - 1;
+    pool->slots = (PoolSlot*)calloc((size_t)1 << slot_bits, sizeof(PoolSlot));
+
+    bptree_destroy(bptree);
+    bptree_init_order(bptree, header.order);
+    arena_release(&bptree->arena);
+    bptree->pool = pool;
+    bptree->root = (BPNode*)pinned;
+    return true;
+}
+
+// Sharded trees: keys split by range over independent trees, each
+// written by its own thread. A shard's nodes, arena and root belong to
+// it alone, so a batch of inserts or a bulk load runs on every shard at
+// once with no locks and no cache lines shared between writers. A
+// lookup first picks the shard from a small sorted array of splitters,
+// the lowest key of every shard but the first, searched with the same
+// kernel as a node.
+//
+// Splitters are taken from the keys of the last sharded_bulk_load, so
+// each shard starts with an equal share; until then every key goes to
+// the first shard.
+typedef struct ShardedTree {
+    int capacity;           // Trees in shards
+    int count;              // Shards in use
+    BPTree* shards;
+    bpkey_t* splitters;     // count - 1 of them
+    UpperBoundFn route;
+} ShardedTree;
+
+typedef struct ShardWorker {
+    pthread_t thread;
+    BPTree* shard;
+    const bpkey_t* keys;
+    const bpval_t* values;
+    long n;
+    long first;             // Position of keys[0] in the whole batch
+    double fill;
+    bpkey_t low;            // Keys in [low, high) are this shard's
+    bpkey_t high;
+    bool has_low;
+    bool has_high;
+} ShardWorker;
+
+void sharded_init(ShardedTree* sharded, int shards, int order) {
+    sharded->capacity = shards;
+    sharded->count = 1;
+    sharded->shards = (BPTree*)malloc(sizeof(BPTree) * shards);
+    sharded->splitters = (bpkey_t*)malloc(sizeof(bpkey_t) * shards);
+    if (sharded->shards == NULL || sharded->splitters == NULL) {
+        printf("Failed to allocate shards\n");
+        exit(1);
+    }
+    for (int s = 0; s < shards; s++) {
+        bptree_init_order(&sharded->shards[s], order);
+    }
+    sharded->route = search_kernel_for(0).upper_bound;
+}
+
+void sharded_destroy(ShardedTree* sharded) {
+    for (int s = 0; s < sharded->capacity; s++) {
+        bptree_destroy(&sharded->shards[s]);
+    }
+    free(sharded->shards);
+    free(sharded->splitters);
+}
+
+static inline BPTree* sharded_shard(ShardedTree* sharded, bpkey_t key) {
+    return &sharded->shards[sharded->route(sharded->splitters, sharded->count - 1, key)];
+}
+
+// The Search refers to a node of the shard that holds key.
+Search sharded_search(ShardedTree* sharded, bpkey_t key) {
+    return bptree_search(sharded_shard(sharded, key), key);
+}
+
+void sharded_insert(ShardedTree* sharded, bpkey_t key, bpval_t value) {
+    bptree_insert(sharded_shard(sharded, key), key, value);
+}
+
+bool sharded_delete(ShardedTree* sharded, bpkey_t key) {
+    return bptree_delete(sharded_shard(sharded, key), key);
+}
+
+static void* shard_load(void* arg) {
+    ShardWorker* w = (ShardWorker*)arg;
+    bpval_t* positions = NULL;
+    if (w->values == NULL) {
+        positions = (bpval_t*)malloc(sizeof(bpval_t) * (w->n > 0 ? w->n : 1));
+        for (long i = 0; i < w->n; i++) {
+            positions[i] = (bpval_t)(w->first + i);
+        }
+    }
+    bptree_bulk_load(w->shard, w->keys, w->values != NULL ? w->values : positions, w->n, w->fill,
+                     1);
+    free(positions);
+    return NULL;
+}
+
+// Every worker reads the whole batch and keeps the keys in its range:
+// two compares a key, instead of a partitioning pass that one thread
+// would have to make before the others could start.
+static void* shard_insert(void* arg) {
+    ShardWorker* w = (ShardWorker*)arg;
+    for (long i = 0; i < w->n; i++) {
+        bpkey_t key = w->keys[i];
+        if ((w->has_low && key_lt(key, w->low)) || (w->has_high && !key_lt(key, w->high))) {
+            continue;
+        }
+        bptree_insert(w->shard, key, w->values != NULL ? w->values[i] : (bpval_t)i);
+    }
+    return NULL;
+}
+
+static void shard_workers_run(ShardWorker* workers, int count, void* (*run)(void*)) {
+    for (int s = 0; s < count; s++) {
+        pthread_create(&workers[s].thread, NULL, run, &workers[s]);
+    }
+    for (int s = 0; s < count; s++) {
+        pthread_join(workers[s].thread, NULL);
+    }
+}
+
+// Like bptree_bulk_load over all shards: the sorted keys are cut into
+// equal runs, one per shard, which become the new splitters, and every
+// shard builds its tree on its own thread.
+void sharded_bulk_load(ShardedTree* sharded, const bpkey_t* keys, const bpval_t* values, long n,
+                       double fill) {
+    int count = n < sharded->capacity ? (int)(n > 0 ? n : 1) : sharded->capacity;
+    ShardWorker* workers = (ShardWorker*)calloc(sharded->capacity, sizeof(ShardWorker));
+    for (int s = 0; s < sharded->capacity; s++) {
+        long first = s < count ? s * n / count : n;
+        long last = s < count ? (s + 1) * n / count : n;
+        workers[s].shard = &sharded->shards[s];
+        workers[s].keys = keys + first;
+        workers[s].values = values != NULL ? values + first : NULL;
+        workers[s].n = last - first;
+        workers[s].first = first;
+        workers[s].fill = fill;
+        if (s > 0 && s < count) {
+            sharded->splitters[s - 1] = keys[first];
+        }
+    }
+    sharded->count = count;
+    shard_workers_run(workers, sharded->capacity, shard_load);
+    free(workers);
+}
+
+// Insert n keys (with values, or their positions if values is NULL),
+// one thread per shard. Needs the trees to itself, like bptree_merge.
+void sharded_insert_batch(ShardedTree* sharded, const bpkey_t* keys, const bpval_t* values,
+                          long n) {
+    ShardWorker* workers = (ShardWorker*)calloc(sharded->count, sizeof(ShardWorker));
+    for (int s = 0; s < sharded->count; s++) {
+        workers[s].shard = &sharded->shards[s];
+        workers[s].keys = keys;
+        workers[s].values = values;
+        workers[s].n = n;
+        workers[s].has_low = s > 0;
+        workers[s].has_high = s < sharded->count - 1;
+        if (workers[s].has_low) {
+            workers[s].low = sharded->splitters[s - 1];
+        }
+        if (workers[s].has_high) {
+            workers[s].high = sharded->splitters[s];
+        }
+    }
+    shard_workers_run(workers, sharded->count, shard_insert);
+    free(workers);
+}
+
+// Hardware counters for a phase of work (a bulk load, a run of searches
+// or inserts), read through perf_event_open and reported per operation
+// next to the software counters (OpCounters). Events count this thread
+// and the threads it starts after perf_counters_open, in user space
+// only; a phase is the difference between two reads, since counts of
+// threads that have exited can't be reset. Each event is opened on its
+// own, so a missing one (VMs often have no PMU, and perf_event_paranoid
+// may forbid them) shows as n/a without losing the rest. The kernel
+// time-shares events it can't count at once, and counts are scaled up
+// by the share they ran.
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_EVENTS
+};
+
+static const struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1d misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"dTLB misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+typedef struct PerfCounters {
+    int fd[PERF_EVENTS];             // -1 if the event couldn't be opened
+    uint64_t start[PERF_EVENTS][3];  // Count, time enabled, time running
+    double count[PERF_EVENTS];       // Of the last phase, or -1
+    OpCounters ops;                  // Of the last phase, this thread only
+} PerfCounters;
+
+void perf_counters_open(PerfCounters* perf) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[e].type;
+        attr.config = perf_events[e].config;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf->fd[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        perf->count[e] = -1;
+    }
+}
+
+void perf_counters_close(PerfCounters* perf) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (perf->fd[e] >= 0) {
+            close(perf->fd[e]);
+        }
+    }
+}
+
+static bool perf_read(int fd, uint64_t value[3]) {
+    return fd >= 0 && read(fd, value, 3 * sizeof(uint64_t)) == 3 * sizeof(uint64_t);
+}
+
+void perf_counters_start(PerfCounters* perf) {
+#ifdef BPTREE_COUNTERS
+    perf->ops = op_counters;
+#endif
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (!perf_read(perf->fd[e], perf->start[e])) {
+            perf->start[e][0] = perf->start[e][1] = perf->start[e][2] = 0;
+        }
+    }
+}
+
+void perf_counters_stop(PerfCounters* perf) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        uint64_t now[3];
+        perf->count[e] = -1;
+        if (perf_read(perf->fd[e], now) && now[2] > perf->start[e][2]) {
+            perf->count[e] = (double)(now[0] - perf->start[e][0]) *
+                             (now[1] - perf->start[e][1]) / (now[2] - perf->start[e][2]);
+        }
+    }
+#ifdef BPTREE_COUNTERS
+    perf->ops.nodes_visited = op_counters.nodes_visited - perf->ops.nodes_visited;
+    perf->ops.keys_compared = op_counters.keys_compared - perf->ops.keys_compared;
+#endif
+}
+
+// One line per counter, divided by the phase's operation count.
+void perf_counters_print(PerfCounters* perf, long ops) {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (perf->count[e] < 0) {
+            printf("  %-16s n/a\n", perf_events[e].name);
+        } else {
+            printf("  %-16s %.2f\n", perf_events[e].name, perf->count[e] / ops);
+        }
+    }
+#ifdef BPTREE_COUNTERS
+    printf("  %-16s %.2f\n", "nodes visited", (double)perf->ops.nodes_visited / ops);
+    printf("  %-16s %.2f\n", "keys compared", (double)perf->ops.keys_compared / ops);
+#else
+    printf("  nodes visited and keys compared need -DBPTREE_COUNTERS\n");
+#endif
+}
+
+int max_threads = 0;  // -t; 0 means every online CPU
+const char* tree_file = "bptree.tree";  // -f
+bool huge_pages = false;  // -p
+
+static double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run_example_1() {
+    BPNode* root = NULL;
+    int test_values[] = {10, 20, 30, 40, 50, 60, 70, 80, 90};
+    int n = sizeof(test_values) / sizeof(test_values[0]);
+    
+    printf("\nExample 1: Basic B+ Tree Operations\n");
+    printf("Inserting values: 10, 20, 30, 40, 50, 60, 70, 80, 90\n");
+    
+    for(int i = 0; i < n; i++) {
+        bptree_insert(&bptree, key_from_long(test_values[i]), test_values[i]);
+        printf("\nAfter inserting %d:\n", test_values[i]);
+        print_tree(bptree.root, 0);
+        printf("------------------------\n");
+    }
+    
+    int search_keys[] = {30, 50, 90, 100};
+    for (int i = 0; i < 4; i++) {
+        search_and_print(&bptree, search_keys[i]);
+    }
+}
+
+void run_example_2() {
+    
+    // Insert values in a pattern that allows for fuller nodes
+    // First batch: multiples of 3
+    for(int i = 3; i <= 99; i += 3) {
+        printf("inserting %d\n", i);
+        bptree_insert(&bptree, key_from_long(i), i);
+    }
+    
+    // Second batch: multiples of 3 plus 1
+    for(int i = 1; i <= 100; i += 3) {
+        bptree_insert(&bptree, key_from_long(i), i);
+    }
+    
+    // Final batch: multiples of 3 plus 2
+    for(int i = 2; i <= 98; i += 3) {
+        bptree_insert(&bptree, key_from_long(i), i);
+    }
+    
+    printf("\nTree after inserting values in non-sequential order:\n");
+    print_tree(bptree.root, 0);
+}
+
+void run_example_3() {
+    printf("\nExample 3: Bulk Loading B+ Tree\n");
+    
+    // Create sorted array of keys 1-100
+    bpkey_t keys[100];
+    for (int i = 0; i < 100; i++) {
+        keys[i] = key_from_long(i + 1);
+    }
+    
+    // Bulk load the tree
+    bptree_bulk_insert(&bptree, keys, NULL, 100);
+    
+    printf("\nTree after bulk loading values 1-100:\n");
+    print_tree(bptree.root, 0);
+    
+    // Test some searches
+    int search_keys[] = {1, 50, 100, 101};
+    for (int i = 0; i < 4; i++) {
+        search_and_print(&bptree, search_keys[i]);
+    }
+}
+
+void run_example_4() {
+    printf("\nExample 4: Sequential Insertion\n");
+    printf("Keys above every key in the tree are appended to the rightmost\n");
+    printf("leaf, and its splits leave the left leaf full.\n\n");
+    
+    // Insert values 1-9 one at a time
+    for(int i = 1; i <= 9; i++) {
+        bptree_insert(&bptree, key_from_long(i), i);
+        printf("\nAfter inserting %d:\n", i);
+        print_tree(bptree.root, 0);
+        
+        if (i == 4) {
+            printf("Note: Leaf node is now full with [1 2 3 4]\n");
+        }
+        if (i == 5) {
+            printf("\nNote: When 5 is inserted, we must split:\n");
+            printf("- Left leaf keeps [1 2 3 4]\n");
+            printf("- Right leaf gets [5]\n");
+            printf("- Parent gets [5]\n");
+            printf("\nAn even split would leave [1 2] half empty for good,\n");
+            printf("since any new key would be >= 5!\n");
+        }
+        printf("------------------------\n");
+    }
+}
+
+void run_example_5() {
+    int test_values[] = {10, 20, 30, 25};
+    
+    printf("\nExample 5: Non-Sequential Insertion Pattern\n");
+    printf("Inserting values in order: 10, 20, 30, 25\n");
+    
+    for(int i = 0; i < 4; i++) {
+        bptree_insert(&bptree, key_from_long(test_values[i]), test_values[i]);
+        printf("\nAfter inserting %d:\n", test_values[i]);
+        print_tree(bptree.root, 0);
+        printf("------------------------\n");
+    }
+    
+    // Test searches
+    printf("\nTesting searches:\n");
+    for (int i = 0; i < 4; i++) {
+        search_and_print(&bptree, test_values[i]);
+    }
+}
+
+void run_example_6() {
+    printf("\nExample 6: Range Scan Over Linked Leaves\n");
+
+    bpkey_t keys[100];
+    bpval_t values[100];
+    for (int i = 0; i < 100; i++) {
+        keys[i] = key_from_long(i + 1);
+        values[i] = 1000 + i + 1;
+    }
+    bptree_bulk_insert(&bptree, keys, values, 100);
+
+    bpkey_t out[100];
+    bpval_t out_values[100];
+    int n = bptree_scan(&bptree, key_from_long(25), key_from_long(40), out, out_values, 100);
+    printf("\nScan [25, 40] returned %d keys:\n  ", n);
+    for (int i = 0; i < n; i++) {
+        key_print(out[i]);
+        printf(" ");
+    }
+    printf("\n");
+
+    n = bptree_scan(&bptree, key_from_long(10), key_from_long(90), out, out_values, 5);
+    printf("\nScan [10, 90] limited to 5 keys, with values:\n  ");
+    for (int i = 0; i < n; i++) {
+        key_print(out[i]);
+        printf("=%llu ", (unsigned long long)out_values[i]);
+    }
+    printf("\n");
+
+    printf("\nCursor from 96 to the end:\n  ");
+    for (Cursor c = bptree_seek(&bptree, key_from_long(96)); cursor_valid(&c); cursor_next(&c)) {
+        key_print(cursor_key(&c));
+        printf(" ");
+    }
+    printf("\n");
+}
+
+void run_example_7() {
+    int test_values[] = {10, 20, 30, 40, 50, 60, 70, 80, 90};
+    int n = sizeof(test_values) / sizeof(test_values[0]);
+    int delete_values[] = {20, 10, 60, 70, 80, 90, 100};
+    int ndelete = sizeof(delete_values) / sizeof(delete_values[0]);
+
+    printf("\nExample 7: Deletion with Borrowing and Merging\n");
+    printf("Inserting values: 10, 20, 30, 40, 50, 60, 70, 80, 90\n");
+
+    for (int i = 0; i < n; i++) {
+        bptree_insert(&bptree, key_from_long(test_values[i]), test_values[i]);
+    }
+    print_tree(bptree.root, 0);
+    printf("------------------------\n");
+
+    for (int i = 0; i < ndelete; i++) {
+        bool deleted = bptree_delete(&bptree, key_from_long(delete_values[i]));
+        printf("\nAfter deleting %d%s:\n", delete_values[i],
+               deleted ? "" : " (not found)");
+        print_tree(bptree.root, 0);
+        printf("------------------------\n");
+    }
+}
+
+void run_example_10() {
+    int test_values[] = {10, 20, 30, 40, 50};
+    
+    printf("\nExample 10: Simple Sequential Insertion\n");
+    printf("Inserting values in order: 10, 20, 30, 40\n");
+    
+    for(int i = 0; i < 4; i++) {
+        bptree_insert(&bptree, key_from_long(test_values[i]), test_values[i]);
+
+        printf("\nAfter inserting %d:\n", test_values[i]);
+        print_tree(bptree.root, 0);
+        printf("------------------------\n");
+    }
+}
+
+void run_example_11() {
+    int test_values[] = {10, 20, 30, 40, 25, 26, 29};
+    int n = sizeof(test_values) / sizeof(test_values[0]);
+    
+    printf("\nExample 11: Mixed Sequential and Non-Sequential Insertion\n");
+    printf("Inserting values: 10, 20, 30, 40, 25, 26, 29\n");
+    
+    for(int i = 0; i < n; i++) {
+        bptree_insert(&bptree, key_from_long(test_values[i]), test_values[i]);
+        printf("\nAfter inserting %d:\n", test_values[i]);
+        print_tree(bptree.root, 0);
+        printf("------------------------\n");
+    }
+}
+
+void run_example_12() {
+    int test_values[] = {10, 20, 30, 40, 25};
+    int n = sizeof(test_values) / sizeof(test_values[0]);
+    
+    printf("\nExample 12: Mixed Sequential and Non-Sequential Insertion\n");
+    printf("Inserting values: 10, 20, 30, 40, 25\n");
+    
+    for(int i = 0; i < n; i++) {
+        bptree_insert(&bptree, key_from_long(test_values[i]), test_values[i]);
+        printf("\nAfter inserting %d:\n", test_values[i]);
+        print_tree(bptree.root, 0);
+        printf("------------------------\n");
+    }
+}
+
+int bptree_height(BPTree* bptree) {
+    if (bptree->root == NULL) return 0;
+    
+    int height = 1;
+    BPNode* node = bptree->root;
+    while (node->type != LEAF) {
+        height++;
+        // Follow leftmost path
+        node = bptree->pool != NULL ? pool_child(bptree->pool, node, 0) : node_child(bptree, node, 0);
+    }
+    return height;
+}
+
+// The shape of a tree, from bptree_stats. Levels count from the root.
+// The walk is depth first, so it needs memory for one path down, not a
+// queue of whole levels: it can be taken from a live process between
+// writes (it needs the tree to itself, like a scan). Trees opened from
+// a file work too; paged trees don't, since the walk would push every
+// node through the pool.
+#define STATS_MAX_LEVELS 64
+#define STATS_FILL_BUCKETS 10
+
+typedef struct TreeStats {
+    int height;
+    long nodes[STATS_MAX_LEVELS];
+    long keys[STATS_MAX_LEVELS];          // Entries in leaves, separators above
+    long leaf_fill[STATS_FILL_BUCKETS];   // Leaves by keys over max keys, in tenths; full is in the last
+    long internal_fill[STATS_FILL_BUCKETS];
+    long leaf_formats[LEAF_FORMATS];
+    long leaf_chain;        // Leaves reached along next links from the first
+    long buffered;          // Messages in insert buffers
+    size_t node_bytes;      // Taken by the nodes in the tree
+    size_t reserved_bytes;  // Arena chunks or file mapping, free nodes included
+    size_t index_bytes;     // Key filter and top index
+} TreeStats;
+
+static void stats_walk(BPTree* bptree, BPNode* node, int level, TreeStats* stats) {
+    if (level >= STATS_MAX_LEVELS) {
+        return;
+    }
+    if (level >= stats->height) {
+        stats->height = level + 1;
+    }
+    stats->nodes[level]++;
+    stats->keys[level] += node->nkeys;
+    int max_keys = node_max_keys(bptree, node);
+    int bucket = max_keys > 0 ? (int)((long)node->nkeys * STATS_FILL_BUCKETS / max_keys) : 0;
+    bucket = bucket < STATS_FILL_BUCKETS ? bucket : STATS_FILL_BUCKETS - 1;
+    stats->node_bytes += bptree->arena.pools[node->type].node_bytes;
+
+    if (node->type == LEAF) {
+        stats->leaf_fill[bucket]++;
+        stats->leaf_formats[node->format]++;
+        return;
+    }
+    stats->internal_fill[bucket]++;
+    if (bptree->buffer_messages > 0) {
+        stats->buffered += *buffer_count(node);
+    }
+    for (int i = 0; i <= node->nkeys; i++) {
+        stats_walk(bptree, node_child(bptree, node, i), level + 1, stats);
+    }
+}
+
+// Fill in stats for the tree. Returns false, leaving them zero, for
+// paged trees.
+bool bptree_stats(BPTree* bptree, TreeStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (bptree->root == NULL || bptree->pool != NULL) {
+        return false;
+    }
+    stats_walk(bptree, bptree->root, 0, stats);
+    for (BPNode* leaf = first_leaf(bptree); leaf != NULL; leaf = leaf_next(bptree->node_base, leaf)) {
+        stats->leaf_chain++;
+    }
+    stats->reserved_bytes = bptree->map != NULL ? bptree->map_bytes : bptree->arena.bytes;
+    if (bptree->filter != NULL) {
+        stats->index_bytes += bptree->filter->block_count * FILTER_BLOCK_WORDS * sizeof(uint64_t);
+    }
+    if (bptree->top_valid) {
+        stats->index_bytes += (sizeof(bpkey_t) + sizeof(BPNode*)) * (bptree->top.count + 1);
+    }
+    return true;
+}
+
+void bptree_print_stats(const TreeStats* stats) {
+    printf("Height %d, %ld leaves on the chain\n", stats->height, stats->leaf_chain);
+    for (int level = 0; level < stats->height; level++) {
+        printf("Level %d: %ld nodes, %ld keys, %.2f keys per node\n", level, stats->nodes[level],
+               stats->keys[level], (double)stats->keys[level] / stats->nodes[level]);
+    }
+    const char* names[] = {"Leaf fill:    ", "Internal fill:"};
+    const long* fills[] = {stats->leaf_fill, stats->internal_fill};
+    for (int f = 0; f < 2; f++) {
+        printf("%s", names[f]);
+        for (int i = 0; i < STATS_FILL_BUCKETS; i++) {
+            printf(" %d%%: %ld", 100 * i / STATS_FILL_BUCKETS, fills[f][i]);
+        }
+        printf("\n");
+    }
+    printf("Leaves: %ld plain, %ld 16-bit, %ld 8-bit\n", stats->leaf_formats[KEYS_PLAIN],
+           stats->leaf_formats[KEYS_FOR16], stats->leaf_formats[KEYS_FOR8]);
+    if (stats->buffered > 0) {
+        printf("Buffered: %ld messages\n", stats->buffered);
+    }
+    printf("Memory: %.1f MB in nodes, %.1f MB reserved, %.1f MB in indexes\n",
+           stats->node_bytes / (1024.0 * 1024.0), stats->reserved_bytes / (1024.0 * 1024.0),
+           stats->index_bytes / (1024.0 * 1024.0));
+}
+
+// Keys per node over the order: 2.0 when every node is full.
+double bptree_avg_keys(BPTree* bptree) {
+    TreeStats stats;
+    if (!bptree_stats(bptree, &stats)) {
+        return 0;
+    }
+    long nodes = 0;
+    long keys = 0;
+    for (int level = 0; level < stats.height; level++) {
+        nodes += stats.nodes[level];
+        keys += stats.keys[level];
+    }
+    return (double)keys / ((double)nodes * bptree->order);
+}
+
+void example_100() {
+    const int N = 100000000;  // 100M elements
+    const int SEARCHES = 1000000;  // 1M searches
+    
+    printf("Order: %d\n", bptree.order);
+    printf("Key type: %s\n", KEY_TYPE_NAME);
+    printf("Search kernel: %s\n", bptree.kernel_name);
+    
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(i);
+    }
+    
+    double load_start = wall_seconds();
+    bptree_bulk_load(&bptree, keys, NULL, N, 1.0, max_threads);
+    double bulk_time = wall_seconds() - load_start;
+    
+    // Measure tree characteristics
+    int height = bptree_height(&bptree);
+    double avg_keys = bptree_avg_keys(&bptree);
+    printf("Bulk load time: %.2f seconds\n", bulk_time);
+    printf("Node memory: %.1f MB\n", bptree.arena.bytes / (1024.0 * 1024.0));
+    printf("Tree height: %d\n", height);
+    printf("Average keys per node: %.2f\n", avg_keys);
+    
+    free(keys);
+    
+    // Rest of the search benchmark code...
+    clock_t start = clock();
+    int found = 0;
+    for (int i = 0; i < SEARCHES; i++) {
+        bpkey_t key = key_from_long(rand() % N);
+        Search result = bptree_search(&bptree, key);
+        if (result.node != NULL) {
+            found++;
+        }
+    }
+    clock_t end = clock();
+    
+    double search_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    double avg_search_time = (search_time * 1000000.0) / SEARCHES;
+    
+    printf("Average search time: %.2f microseconds\n", avg_search_time);
+}
+
+void example_101() {
+    const int N = 100000000;  // 100M elements
+    const long SCAN_KEYS = 10000000;  // ~10M keys read per range length
+    int lengths[] = {10, 100, 1000, 10000, 100000};
+    int nlengths = sizeof(lengths) / sizeof(lengths[0]);
+
+    printf("Order: %d\n", bptree.order);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(i);
+    }
+    bptree_bulk_insert(&bptree, keys, NULL, N);
+    free(keys);
+
+    bpkey_t* out = (bpkey_t*)malloc(sizeof(bpkey_t) * lengths[nlengths - 1]);
+    bpval_t* out_values = (bpval_t*)malloc(sizeof(bpval_t) * lengths[nlengths - 1]);
+
+    for (int l = 0; l < nlengths; l++) {
+        int len = lengths[l];
+        long scans = SCAN_KEYS / len;
+        long total = 0;
+
+        clock_t start = clock();
+        for (long s = 0; s < scans; s++) {
+            int lo = rand() % (N - len);
+            total += bptree_scan(&bptree, key_from_long(lo), key_from_long(lo + len - 1),
+                                 out, out_values, len);
+        }
+        clock_t end = clock();
+
+        double scan_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+        printf("Range length %6d: %ld scans, %.2f million keys/second\n",
+               len, scans, total / scan_time / 1000000.0);
+    }
+
+    free(out);
+    free(out_values);
+}
+
+void example_102() {
+    const int N = 10000000;  // 10M elements
+    const int ROUNDS = 10;
+    const int CHURN = 1000000;  // deletes and inserts per round
+    const int SEARCHES = 1000000;
+
+    printf("Order: %d\n", bptree.order);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(i);
+    }
+    bptree_bulk_insert(&bptree, keys, NULL, N);
+    free(keys);
+
+    // Keys are drawn from [0, 2N), so about half of the inserts
+    // land on keys the deletes just removed.
+    for (int round = 0; round <= ROUNDS; round++) {
+        if (round > 0) {
+            for (int i = 0; i < CHURN; i++) {
+                bptree_delete(&bptree, key_from_long(rand() % (2 * N)));
+                int key = rand() % (2 * N);
+                if (bptree_search(&bptree, key_from_long(key)).node == NULL) {
+                    bptree_insert(&bptree, key_from_long(key), key);
+                }
+            }
+        }
+
+        clock_t start = clock();
+        for (int i = 0; i < SEARCHES; i++) {
+            bptree_search(&bptree, key_from_long(rand() % (2 * N)));
+        }
+        clock_t end = clock();
+        double search_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+        printf("Round %2d: height %d, average keys per node %.2f, "
+               "average search time %.2f microseconds\n",
+               round, bptree_height(&bptree), bptree_avg_keys(&bptree),
+               search_time * 1000000.0 / SEARCHES);
+    }
+}
+
+void example_103() {
+    const int N = 10000000;  // 10M elements per tree
+    const int SEARCHES = 1000000;
+    int orders[] = {
+        order_for_leaf_bytes(64),
+        order_for_leaf_bytes(128),
+        order_for_leaf_bytes(256),
+        60,
+        order_for_leaf_bytes(4096),
+    };
+    int ntrees = sizeof(orders) / sizeof(orders[0]);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(i);
+    }
+
+    // All of the trees live side by side in this one process.
+    BPTree* trees = (BPTree*)malloc(sizeof(BPTree) * ntrees);
+    for (int t = 0; t < ntrees; t++) {
+        bptree_init_order(&trees[t], orders[t]);
+        bptree_bulk_insert(&trees[t], keys, NULL, N);
+    }
+    free(keys);
+
+    for (int t = 0; t < ntrees; t++) {
+        clock_t start = clock();
+        for (int i = 0; i < SEARCHES; i++) {
+            bptree_search(&trees[t], key_from_long(rand() % N));
+        }
+        clock_t end = clock();
+        double search_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+        printf("Order %3d (%5zu bytes of header and keys, kernel %s): height %d, "
+               "average search time %.2f microseconds\n",
+               trees[t].order, node_children_offset(trees[t].key_slots), trees[t].kernel_name,
+               bptree_height(&trees[t]), search_time * 1000000.0 / SEARCHES);
+    }
+
+    for (int t = 0; t < ntrees; t++) {
+        bptree_destroy(&trees[t]);
+    }
+    free(trees);
+}
+
+void example_104() {
+    const int N = 100000000;  // 100M elements
+    const int SEARCHES = 1000000;  // 1M searches
+    int batch_sizes[] = {1, 16, 64, 256, 1024};
+    int nbatch_sizes = sizeof(batch_sizes) / sizeof(batch_sizes[0]);
+
+    printf("Order: %d\n", bptree.order);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(i);
+    }
+    bptree_bulk_insert(&bptree, keys, NULL, N);
+
+    for (int i = 0; i < SEARCHES; i++) {
+        keys[i] = key_from_long(rand() % N);
+    }
+    Search* results = (Search*)malloc(sizeof(Search) * SEARCHES);
+
+    clock_t start = clock();
+    int found = 0;
+    for (int i = 0; i < SEARCHES; i++) {
+        if (bptree_search(&bptree, keys[i]).node != NULL) {
+            found++;
+        }
+    }
+    clock_t end = clock();
+    double search_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+    printf("One at a time: %.3f microseconds per search (%d found)\n",
+           search_time * 1000000.0 / SEARCHES, found);
+
+    for (int b = 0; b < nbatch_sizes; b++) {
+        int batch = batch_sizes[b];
+        start = clock();
+        for (int i = 0; i < SEARCHES; i += batch) {
+            int count = SEARCHES - i < batch ? SEARCHES - i : batch;
+            bptree_search_batch(&bptree, keys + i, count, results + i);
+        }
+        end = clock();
+
+        found = 0;
+        for (int i = 0; i < SEARCHES; i++) {
+            if (results[i].node != NULL) {
+                found++;
+            }
+        }
+        search_time = ((double)(end - start)) / CLOCKS_PER_SEC;
+        printf("Batches of %4d: %.3f microseconds per search (%d found)\n",
+               batch, search_time * 1000000.0 / SEARCHES, found);
+    }
+
+    free(keys);
+    free(results);
+}
+
+typedef struct OlcWorker {
+    BPTree* bptree;
+    pthread_t thread;
+    uint64_t seed;
+    long ops;
+    int read_percent;
+    int key_space;
+} OlcWorker;
+
+static uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// The tree holds the even keys; inserts add odd ones, spread over the
+// whole key space so writers rarely meet in the same leaf.
+void* olc_worker_run(void* arg) {
+    OlcWorker* worker = (OlcWorker*)arg;
+    for (long i = 0; i < worker->ops; i++) {
+        uint64_t r = xorshift64(&worker->seed);
+        int key = (int)((r >> 8) % worker->key_space);
+        if ((int)(r % 100) < worker->read_percent) {
+            bptree_search_olc(worker->bptree, key_from_long(key & ~1), NULL);
+        } else {
+            bptree_insert_olc(worker->bptree, key_from_long(key | 1), key | 1);
+        }
+    }
+    return NULL;
+}
+
+void example_106() {
+    const int N = 100000000;  // 100M elements
+    const int INSERTS = 1000000;
+    double fills[] = {1.0, 0.9, 0.8, 0.7};
+    int nfills = sizeof(fills) / sizeof(fills[0]);
+
+    int threads_max = max_threads > 0 ? max_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    printf("Order: %d\n", bptree.order);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(2 * i);
+    }
+
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > threads_max) {
+            threads = threads_max;
+        }
+        double start = wall_seconds();
+        bptree_bulk_load(&bptree, keys, NULL, N, 1.0, threads);
+        printf("Load with %2d threads: %.2f seconds\n", threads, wall_seconds() - start);
+        if (threads == threads_max) {
+            break;
+        }
+    }
+
+    // Odd keys land between the loaded even keys, all over the tree.
+    for (int f = 0; f < nfills; f++) {
+        bptree_bulk_load(&bptree, keys, NULL, N, fills[f], threads_max);
+        double loaded_mb = bptree.arena.bytes / (1024.0 * 1024.0);
+
+        double start = wall_seconds();
+        for (int i = 0; i < INSERTS; i++) {
+            int key = (rand() % N) * 2 + 1;
+            bptree_insert(&bptree, key_from_long(key), key);
+        }
+        double insert_time = wall_seconds() - start;
+
+        printf("Fill %.1f: %.0f MB after load, %.0f MB after %d inserts, "
+               "%.2f microseconds per insert\n",
+               fills[f], loaded_mb, bptree.arena.bytes / (1024.0 * 1024.0), INSERTS,
+               insert_time * 1000000.0 / INSERTS);
+    }
+
+    free(keys);
+}
+
+void example_105() {
+    const int N = 10000000;  // 10M elements
+    const long OPS_PER_THREAD = 2000000;
+    int read_percents[] = {100, 90, 50};
+    int nworkloads = sizeof(read_percents) / sizeof(read_percents[0]);
+
+    int threads_max = max_threads > 0 ? max_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    printf("Order: %d\n", bptree.order);
+    printf("threads,read_percent,mops_per_second\n");
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(2 * i);
+    }
+    OlcWorker* workers = (OlcWorker*)malloc(sizeof(OlcWorker) * threads_max);
+
+    for (int w = 0; w < nworkloads; w++) {
+        // 1, 2, 4, ... threads, ending at exactly threads_max.
+        for (int threads = 1; ; threads *= 2) {
+            if (threads > threads_max) {
+                threads = threads_max;
+            }
+            bptree_bulk_insert(&bptree, keys, NULL, N);
+
+            for (int t = 0; t < threads; t++) {
+                workers[t].bptree = &bptree;
+                workers[t].seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+                workers[t].ops = OPS_PER_THREAD;
+                workers[t].read_percent = read_percents[w];
+                workers[t].key_space = 2 * N;
+            }
+
+            double start = wall_seconds();
+            for (int t = 0; t < threads; t++) {
+                pthread_create(&workers[t].thread, NULL, olc_worker_run, &workers[t]);
+            }
+            for (int t = 0; t < threads; t++) {
+                pthread_join(workers[t].thread, NULL);
+            }
+            double elapsed = wall_seconds() - start;
+
+            printf("%d,%d,%.2f\n", threads, read_percents[w],
+                   threads * OPS_PER_THREAD / elapsed / 1000000.0);
+            if (threads == threads_max) {
+                break;
+            }
+        }
+    }
+
+    free(workers);
+    free(keys);
+}
+
+// Counts leaves per format, from the leftmost leaf along the next links.
+void example_107() {
+    const int N = 10000000;  // 10M elements
+    const int SEARCHES = 1000000;
+    const char* patterns[] = {"stride 1", "stride 20", "random gaps 1-38", "random gaps 1-200"};
+    int npatterns = sizeof(patterns) / sizeof(patterns[0]);
+
+    printf("Order: %d\n", bptree.order);
+    printf("Entries per leaf: %d plain, %d 16-bit, %d 8-bit\n",
+           bptree.leaf_max_keys[KEYS_PLAIN], bptree.leaf_max_keys[KEYS_FOR16],
+           bptree.leaf_max_keys[KEYS_FOR8]);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    bpkey_t* probes = (bpkey_t*)malloc(sizeof(bpkey_t) * SEARCHES);
+
+    for (int p = 0; p < npatterns; p++) {
+        long key = 0;
+        for (int i = 0; i < N; i++) {
+            switch (p) {
+                case 0: key += 1; break;
+                case 1: key += 20; break;
+                case 2: key += 1 + rand() % 38; break;
+                default: key += 1 + rand() % 200; break;
+            }
+            keys[i] = key_from_long(key);
+        }
+        for (int i = 0; i < SEARCHES; i++) {
+            probes[i] = keys[rand() % N];
+        }
+
+        for (int pack = 0; pack <= 1; pack++) {
+            bptree_set_leaf_packing(&bptree, pack);
+            double start = wall_seconds();
+            bptree_bulk_load(&bptree, keys, NULL, N, 1.0, max_threads);
+            double load_time = wall_seconds() - start;
+
+            TreeStats stats;
+            bptree_stats(&bptree, &stats);
+
+            start = wall_seconds();
+            int found = 0;
+            for (int i = 0; i < SEARCHES; i++) {
+                found += bptree_search(&bptree, probes[i]).node != NULL;
+            }
+            double search_time = wall_seconds() - start;
+
+            printf("%-17s %s: load %.2f s, %4.0f MB, height %d, "
+                   "leaves %ld plain / %ld 16-bit / %ld 8-bit, "
+                   "%.2f microseconds per search (%d found)\n",
+                   patterns[p], pack ? "packed" : "plain ", load_time,
+                   bptree.arena.bytes / (1024.0 * 1024.0), bptree_height(&bptree),
+                   stats.leaf_formats[KEYS_PLAIN], stats.leaf_formats[KEYS_FOR16],
+                   stats.leaf_formats[KEYS_FOR8],
+                   search_time * 1000000.0 / SEARCHES, found);
+        }
+    }
+    bptree_set_leaf_packing(&bptree, false);
+
+    free(probes);
+    free(keys);
+}
+
+void example_108() {
+    const int N = 100000000;  // 100M elements
+    const int SEARCHES = 1000000;
+
+    printf("Order: %d\n", bptree.order);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(i);
+    }
+    double start = wall_seconds();
+    bptree_bulk_load(&bptree, keys, NULL, N, 1.0, max_threads);
+    printf("Bulk load time: %.2f seconds\n", wall_seconds() - start);
+    free(keys);
+
+    bpkey_t* probes = (bpkey_t*)malloc(sizeof(bpkey_t) * SEARCHES);
+    for (int i = 0; i < SEARCHES; i++) {
+        probes[i] = key_from_long(rand() % N);
+    }
+
+    start = wall_seconds();
+    if (!bptree_save(&bptree, tree_file)) {
+        free(probes);
+        return;
+    }
+    printf("Save time: %.2f seconds\n", wall_seconds() - start);
+
+    // The same searches on the tree in memory, then on the mapped file:
+    // the first pass there faults in the pages it touches.
+    const char* passes[] = {"in memory", "mapped, first pass", "mapped, second pass"};
+    for (int pass = 0; pass < 3; pass++) {
+        if (pass == 1) {
+            start = wall_seconds();
+            if (!bptree_open(&bptree, tree_file)) {
+                break;
+            }
+            printf("Open time: %.3f milliseconds (%.0f MB file)\n",
+                   (wall_seconds() - start) * 1000.0, bptree.map_bytes / (1024.0 * 1024.0));
+        }
+        start = wall_seconds();
+        int found = 0;
+        for (int i = 0; i < SEARCHES; i++) {
+            found += bptree_search(&bptree, probes[i]).node != NULL;
+        }
+        printf("Average search time, %s: %.2f microseconds (%d found)\n", passes[pass],
+               (wall_seconds() - start) * 1000000.0 / SEARCHES, found);
+    }
+
+    unlink(tree_file);
+    free(probes);
+}
+
+// Average microseconds per search over probes, each searched once.
+static double time_searches(BPTree* bptree, const bpkey_t* probes, int n) {
+    double start = wall_seconds();
+    int found = 0;
+    for (int i = 0; i < n; i++) {
+        found += bptree_search(bptree, probes[i]).node != NULL;
+    }
+    if (found != n) {
+        printf("Only %d of %d keys found\n", found, n);
+    }
+    return (wall_seconds() - start) * 1000000.0 / n;
+}
+
+void example_109() {
+    const int N = 100000000;  // 100M elements
+    const int SEARCHES = 1000000;
+    const int HOT_KEYS = N / 100;
+    int cache_divisors[] = {10, 5};
+    int ncaches = sizeof(cache_divisors) / sizeof(cache_divisors[0]);
+
+    printf("Order: %d\n", bptree.order);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(i);
+    }
+    bptree_bulk_load(&bptree, keys, NULL, N, 1.0, max_threads);
+    free(keys);
+
+    // Uniform over every key, and over a hot 1% of them.
+    bpkey_t* uniform = (bpkey_t*)malloc(sizeof(bpkey_t) * SEARCHES);
+    bpkey_t* hot = (bpkey_t*)malloc(sizeof(bpkey_t) * SEARCHES);
+    for (int i = 0; i < SEARCHES; i++) {
+        uniform[i] = key_from_long(rand() % N);
+        hot[i] = key_from_long(N / 2 + rand() % HOT_KEYS);
+    }
+    printf("In memory: uniform %.2f, hot 1%% %.2f microseconds per search\n",
+           time_searches(&bptree, uniform, SEARCHES), time_searches(&bptree, hot, SEARCHES));
+
+    if (!bptree_save(&bptree, tree_file)) {
+        free(hot);
+        free(uniform);
+        return;
+    }
+    struct stat st;
+    stat(tree_file, &st);
+
+    // Each workload runs twice on a fresh pool; the second run is timed.
+    for (int c = 0; c < ncaches; c++) {
+        size_t cache_bytes = (size_t)st.st_size / cache_divisors[c];
+        if (!bptree_open_paged(&bptree, tree_file, cache_bytes)) {
+            break;
+        }
+        BufferPool* pool = bptree.pool;
+        printf("Cache %.0f MB (1/%d of the file, %.1f MB pinned):\n", cache_bytes / (1024.0 * 1024.0),
+               cache_divisors[c], (pool->pinned_end - pool->pinned_start) / (1024.0 * 1024.0));
+
+        const char* names[] = {"uniform", "hot 1%"};
+        bpkey_t* workloads[] = {uniform, hot};
+        for (int w = 0; w < 2; w++) {
+            time_searches(&bptree, workloads[w], SEARCHES);
+            pool->hits = pool->misses = pool->evictions = 0;
+            double us = time_searches(&bptree, workloads[w], SEARCHES);
+            printf("  %-8s %.2f microseconds per search, %ld hits, %ld misses (%.1f%% hits), "
+                   "%ld evictions\n",
+                   names[w], us, pool->hits, pool->misses,
+                   100.0 * pool->hits / (pool->hits + pool->misses), pool->evictions);
+        }
+    }
+
+    unlink(tree_file);
+    free(hot);
+    free(uniform);
+}
+
+void example_110() {
+    const int N = 100000000;  // 100M elements
+    const int OPS = 1000000;
+
+    printf("Order: %d\n", bptree.order);
+    printf("Search kernel: %s\n", bptree.kernel_name);
+    PerfCounters perf;
+    perf_counters_open(&perf);
+
+    // Even keys, so every odd key is a new one to insert.
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(2L * i);
+    }
+    perf_counters_start(&perf);
+    bptree_bulk_load(&bptree, keys, NULL, N, 1.0, max_threads);
+    perf_counters_stop(&perf);
+    printf("Bulk load, per key:\n");
+    perf_counters_print(&perf, N);
+
+    for (int i = 0; i < OPS; i++) {
+        keys[i] = key_from_long(2L * (rand() % N));
+    }
+    int found = 0;
+    perf_counters_start(&perf);
+    for (int i = 0; i < OPS; i++) {
+        found += bptree_search(&bptree, keys[i]).node != NULL;
+    }
+    perf_counters_stop(&perf);
+    printf("Search, per search (%d found):\n", found);
+    perf_counters_print(&perf, OPS);
+
+    for (int i = 0; i < OPS; i++) {
+        keys[i] = key_from_long(2L * (rand() % N) + 1);
+    }
+    perf_counters_start(&perf);
+    for (int i = 0; i < OPS; i++) {
+        bptree_insert(&bptree, keys[i], i);
+    }
+    perf_counters_stop(&perf);
+    printf("Insert, per insert:\n");
+    perf_counters_print(&perf, OPS);
+
+    perf_counters_close(&perf);
+    free(keys);
+}
+
+void example_111() {
+    const int N = 10000000;  // 10M elements
+    long batch_sizes[] = {100000, 1000000, N};
+    int nbatches = sizeof(batch_sizes) / sizeof(batch_sizes[0]);
+
+    printf("Order: %d\n", bptree.order);
+
+    // Even keys in the tree, a sorted batch of odd keys to add.
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    bpkey_t* batch = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(2L * i);
+    }
+
+    for (int b = 0; b < nbatches; b++) {
+        // Every odd key has the same chance, so the batch is spread out
+        // until it is as big as the tree.
+        long count = batch_sizes[b];
+        for (long i = 0, picked = 0; i < N && picked < count; i++) {
+            if (rand() % (N - i) < count - picked) {
+                batch[picked++] = key_from_long(2 * i + 1);
+            }
+        }
+
+        bptree_bulk_load(&bptree, keys, NULL, N, 1.0, max_threads);
+        double start = wall_seconds();
+        for (long i = 0; i < count; i++) {
+            bptree_insert(&bptree, batch[i], i);
+        }
+        double insert_time = wall_seconds() - start;
+
+        bptree_bulk_load(&bptree, keys, NULL, N, 1.0, max_threads);
+        start = wall_seconds();
+        bptree_merge(&bptree, batch, NULL, count);
+        double merge_time = wall_seconds() - start;
+
+        int found = 0;
+        for (long i = 0; i < count; i += 97) {
+            found += bptree_search(&bptree, batch[i]).node != NULL;
+        }
+        printf("%8ld keys: %.2f seconds inserting one at a time, %.2f merging (%d of %ld checked found)\n",
+               count, insert_time, merge_time, found, (count + 96) / 97);
+    }
+
+    free(batch);
+    free(keys);
+}
+
+void example_112() {
+    const int N = 10000000;  // 10M elements
+    TreeStats stats;
+
+    printf("Order: %d\n", bptree.order);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(2L * i);
+    }
+    bptree_bulk_load(&bptree, keys, NULL, N, 1.0, max_threads);
+    free(keys);
+    printf("\nAfter a full bulk load of %d keys:\n", N);
+    bptree_stats(&bptree, &stats);
+    bptree_print_stats(&stats);
+
+    // Random inserts split full nodes in half, so fill drops towards
+    // the 70% a tree built by inserts settles at.
+    for (int i = 0; i < N / 2; i++) {
+        bptree_insert(&bptree, key_from_long(2L * (rand() % N) + 1), i);
+    }
+    printf("\nAfter %d random inserts:\n", N / 2);
+    bptree_stats(&bptree, &stats);
+    bptree_print_stats(&stats);
+}
+
+void example_113() {
+    const int N = 10000000;  // 10M elements
+    const int INSERTS = N / 2;
+    const int SEARCHES = 1000000;
+    int shards = max_threads > 0 ? max_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("Order: %d, %d shards\n", bptree.order, shards);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    bpkey_t* inserts = (bpkey_t*)malloc(sizeof(bpkey_t) * INSERTS);
+    bpkey_t* searches = (bpkey_t*)malloc(sizeof(bpkey_t) * SEARCHES);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(2L * i);
+    }
+    for (int i = 0; i < INSERTS; i++) {
+        inserts[i] = key_from_long(2L * (rand() % N) + 1);
+    }
+    for (int i = 0; i < SEARCHES; i++) {
+        searches[i] = key_from_long(rand() % (2L * N));
+    }
+
+    double start = wall_seconds();
+    bptree_bulk_load(&bptree, keys, NULL, N, 1.0, 1);
+    double load_time = wall_seconds() - start;
+    start = wall_seconds();
+    for (int i = 0; i < INSERTS; i++) {
+        bptree_insert(&bptree, inserts[i], i);
+    }
+    double insert_time = wall_seconds() - start;
+    int found = 0;
+    start = wall_seconds();
+    for (int i = 0; i < SEARCHES; i++) {
+        found += bptree_search(&bptree, searches[i]).node != NULL;
+    }
+    double search_time = wall_seconds() - start;
+    printf("One tree:   load %.2f s, %d inserts %.2f s, %.2f microseconds per search (%d found)\n",
+           load_time, INSERTS, insert_time, search_time * 1000000.0 / SEARCHES, found);
+
+    ShardedTree sharded;
+    sharded_init(&sharded, shards, bptree.order);
+    start = wall_seconds();
+    sharded_bulk_load(&sharded, keys, NULL, N, 1.0);
+    load_time = wall_seconds() - start;
+    start = wall_seconds();
+    sharded_insert_batch(&sharded, inserts, NULL, INSERTS);
+    insert_time = wall_seconds() - start;
+    found = 0;
+    start = wall_seconds();
+    for (int i = 0; i < SEARCHES; i++) {
+        found += sharded_search(&sharded, searches[i]).node != NULL;
+    }
+    search_time = wall_seconds() - start;
+    printf("%3d shards: load %.2f s, %d inserts %.2f s, %.2f microseconds per search (%d found)\n",
+           sharded.count, load_time, INSERTS, insert_time, search_time * 1000000.0 / SEARCHES,
+           found);
+
+    sharded_destroy(&sharded);
+    free(searches);
+    free(inserts);
+    free(keys);
+}
+
+void example_114() {
+    const int N = 10000000;  // 10M elements
+    const int INSERTS = N / 2;
+    const int SEARCHES = 1000000;
+    int buffer_sizes[] = {0, 16, 64, 256};
+    int nsizes = sizeof(buffer_sizes) / sizeof(buffer_sizes[0]);
+
+    printf("Order: %d\n", bptree.order);
+
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    bpkey_t* inserts = (bpkey_t*)malloc(sizeof(bpkey_t) * INSERTS);
+    bpkey_t* searches = (bpkey_t*)malloc(sizeof(bpkey_t) * SEARCHES);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(2L * i);
+    }
+    for (int i = 0; i < INSERTS; i++) {
+        inserts[i] = key_from_long(2L * (rand() % N) + 1);
+    }
+    for (int i = 0; i < SEARCHES; i++) {
+        searches[i] = key_from_long(rand() % (2L * N));
+    }
+
+    for (int s = 0; s < nsizes; s++) {
+        BPTree tree;
+        bptree_init_order(&tree, bptree.order);
+        bptree_set_insert_buffers(&tree, buffer_sizes[s]);
+        bptree_bulk_load(&tree, keys, NULL, N, 1.0, max_threads);
+
+        double start = wall_seconds();
+        for (int i = 0; i < INSERTS; i++) {
+            bptree_insert(&tree, inserts[i], i);
+        }
+        double insert_time = wall_seconds() - start;
+        long buffered = tree.buffered;
+        int found = 0;
+        start = wall_seconds();
+        for (int i = 0; i < SEARCHES; i++) {
+            found += bptree_search(&tree, searches[i]).node != NULL;
+        }
+        double search_time = wall_seconds() - start;
+        start = wall_seconds();
+        bptree_flush_buffers(&tree);
+        double flush_time = wall_seconds() - start;
+
+        // Saving writes standard nodes, so the file opens like any other.
+        BPTree opened;
+        bptree_init_order(&opened, bptree.order);
+        int reopened = -1;
+        if (bptree_save(&tree, tree_file) && bptree_open(&opened, tree_file)) {
+            reopened = 0;
+            for (int i = 0; i < SEARCHES; i++) {
+                reopened += bptree_search(&opened, searches[i]).node != NULL;
+            }
+        }
+        unlink(tree_file);
+
+        printf("%3d messages: %.2f M inserts/s, %.2f microseconds per search (%d found), "
+               "%ld left buffered, flushed in %.3f s, %d found after save and open\n",
+               buffer_sizes[s], INSERTS / insert_time / 1000000.0,
+               search_time * 1000000.0 / SEARCHES, found, buffered, flush_time, reopened);
+        bptree_destroy(&opened);
+        bptree_destroy(&tree);
+    }
+
+    free(searches);
+    free(inserts);
+    free(keys);
+}
+
+// Readers for example_115: scan a fresh snapshot of the whole tree over
+// and over, checking that it holds every loaded (even) key in order,
+// until told to stop.
+typedef struct SnapshotReader {
+    BPTree* bptree;
+    pthread_t thread;
+    long loaded;
+    int max;
+    volatile bool* stop;
+    long scans;
+    long keys;
+    bool consistent;
+} SnapshotReader;
+
+static void* snapshot_reader_run(void* arg) {
+    SnapshotReader* reader = (SnapshotReader*)arg;
+    bpkey_t* out = (bpkey_t*)malloc(sizeof(bpkey_t) * reader->max);
+    reader->consistent = true;
+    while (!__atomic_load_n(reader->stop, __ATOMIC_RELAXED)) {
+        Snapshot snapshot = bptree_snapshot(reader->bptree);
+        int n = snapshot_scan(&snapshot, key_from_long(0),
+                              key_from_long(2 * reader->loaded), out, NULL, reader->max);
+        long even = 0;
+        for (int i = 0; i < n; i++) {
+            if (i > 0 && key_lt(out[i], out[i - 1])) {
+                reader->consistent = false;
+            }
+            even += key_eq(out[i], key_from_long(2 * even));
+        }
+        reader->consistent &= even == reader->loaded;
+        snapshot_release(&snapshot);
+        reader->scans++;
+        reader->keys += n;
     }
-    printf("\n");
+    free(out);
+    return NULL;
 }
 
-typedef struct Parent {
-    BPNode* node;
-    struct Parent* parent;
-} Parent;
+void example_115() {
+    const int N = 1000000;  // 1M elements
+    const int INSERTS = 2000000;
+    int threads = max_threads > 0 ? max_threads : 2;
 
-Parent* parent_new(BPNode* parent_node, Parent* parent, BPNode* left_child) {
-    Parent* p = (Parent*)malloc(sizeof(Parent));
-    p->node = parent_node;
-    p->parent = parent;
+    printf("Order: %d, %d readers\n", bptree.order, threads);
 
-    if (left_child != NULL) {
-        p->node->children[0] = left_child;
+    bpkey_t* keys = (bpkey_t*)malloc(sizeof(bpkey_t) * N);
+    bpkey_t* inserts = (bpkey_t*)malloc(sizeof(bpkey_t) * INSERTS);
+    for (int i = 0; i < N; i++) {
+        keys[i] = key_from_long(2L * i);
+    }
+    for (int i = 0; i < INSERTS; i++) {
+        inserts[i] = key_from_long(2L * (rand() % N) + 1);
     }
 
-    return p;
-}
+    for (int mode = 0; mode < 3; mode++) {
+        BPTree tree;
+        bptree_init_order(&tree, bptree.order);
+        bptree_bulk_load(&tree, keys, NULL, N, 1.0, max_threads);
+        bptree_set_snapshots(&tree, mode > 0);
 
-void parent_free(Parent* p) {
-    while (p != NULL) {
-        Parent* next = p->parent;
-        free(p);
-        p = next;
-    }
-}
+        volatile bool stop = false;
+        int readers = mode == 2 ? threads : 0;
+        SnapshotReader* workers = (SnapshotReader*)calloc(threads, sizeof(SnapshotReader));
+        for (int t = 0; t < readers; t++) {
+            workers[t] = (SnapshotReader){&tree, 0, N, N + INSERTS, &stop, 0, 0, true};
+            pthread_create(&workers[t].thread, NULL, snapshot_reader_run, &workers[t]);
+        }
 
-void parent_insert(Parent* p, int key, BPNode* child) {
-    node_insert_entry(p->node, key, child);
-    
-    // child's parent does not change
-    if (p->node->nkeys <= MAX_KEYS) {
-        return;
-    }
+        double start = wall_seconds();
+        for (int i = 0; i < INSERTS; i++) {
+            bptree_insert(&tree, inserts[i], i);
+        }
+        double insert_time = wall_seconds() - start;
+        long retired = tree.retired.count;
+        __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
 
-    Split split = node_split(p->node, key);
+        long scans = 0;
+        long scanned = 0;
+        bool consistent = true;
+        for (int t = 0; t < readers; t++) {
+            pthread_join(workers[t].thread, NULL);
+            scans += workers[t].scans;
+            scanned += workers[t].keys;
+            consistent &= workers[t].consistent;
+        }
+        bptree_set_snapshots(&tree, false);
 
-    if (p->parent == NULL) {
-        bptree.root = node_new(INTERNAL);
-        p->parent = parent_new(bptree.root, NULL, p->node);
+        printf("%-26s %.2f M inserts/s, %.0f MB",
+               mode == 0 ? "In place:" : mode == 1 ? "Path copying:" : "Path copying, scanning:",
+               INSERTS / insert_time / 1000000.0, tree.arena.bytes / (1024.0 * 1024.0));
+        if (mode > 0) {
+            printf(", %ld nodes retired at the end", retired);
+        }
+        if (readers > 0) {
+            printf(", %ld full scans (%.1f M keys/s), %s", scans, scanned / insert_time / 1000000.0,
+                   consistent ? "all consistent" : "INCONSISTENT");
+        }
+        printf("\n");
+        free(workers);
+        bptree_destroy(&tree);
     }
 
-    parent_insert(p->parent, split.key, split.right);
-    p->node = split.right;
+    free(inserts);
+    free(keys);
 }
 
-void bptree_bulk_insert(BPTree* bptree, int* values, int n) {
-    Parent leaf_parent;
-    leaf_parent.node = node_new(INTERNAL);
-    leaf_parent.parent = NULL;
-    bptree->root = leaf_parent.node;
+// Benchmark driver: `./bptree bench [options]`, one CSV row per trial
+// on stdout (see print_bench_usage). Keys 0, 2, 4, ... are bulk loaded;
+// searches for odd keys miss, and inserts add odd keys. Every thread
+// draws its operations before a trial starts, so the timed loop only
+// runs the operations, with one clock_gettime between each two of them.
+typedef enum KeyDistribution {
+    DIST_SEQUENTIAL,
+    DIST_UNIFORM,
+    DIST_ZIPF,
+    DIST_HIT_MISS,
+} KeyDistribution;
 
-    bool insert_left_child = true;
+enum { OP_SEARCH, OP_INSERT, OP_SCAN };
 
-    int i = 0;
-    while (i < n) {
-        BPNode* leaf = node_new(LEAF);
-        
-        while (i < n && leaf->nkeys < MAX_KEYS) {
-            node_insert_entry(leaf, values[i], NULL);
-            i++;
-        }
+#define BENCH_MAX_ORDERS 64
 
-        if (insert_left_child) {
-            leaf_parent.node->children[0] = leaf;
-            insert_left_child = false;
-            continue;
-        } 
+typedef struct BenchConfig {
+    long keys;                 // -n
+    const char* dist_name;     // -d, as given
+    KeyDistribution dist;
+    double zipf_theta;         // zipf:<theta>
+    int hit_percent;           // hitmiss:<percent>
+    int mix[3];                // -m, percent of OP_SEARCH/OP_INSERT/OP_SCAN
+    int scan_length;           // -l
+    int threads;               // -t
+    long ops;                  // -q, per thread and trial
+    int warmup;                // -w, untimed trials first
+    int trials;                // -r
+    int orders[BENCH_MAX_ORDERS];  // -o and -b
+    int norders;
+    bool pages[2];             // -p: run with small pages, with huge pages
+    bool leaf_search[2];       // -L: run scanning whole leaves, with leaf models
+    int filters[BENCH_MAX_ORDERS];  // -F: key filter bits per key, 0 for none
+    int nfilters;
+    int top_levels[BENCH_MAX_ORDERS];  // -T: levels in the top index, 0 for none
+    int ntop_levels;
+    int buffers[BENCH_MAX_ORDERS];  // -B: insert buffer messages, 0 for none
+    int nbuffers;
+    bool olc;                  // Concurrent inserts go through the OLC API
+} BenchConfig;
 
-        parent_insert(&leaf_parent, leaf->keys[0], leaf);
-    }
+static inline uint64_t bench_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
 
-    parent_free(leaf_parent.parent);
+static inline double bench_uniform(uint64_t* state) {
+    return (bench_random(state) >> 11) * (1.0 / 9007199254740992.0);
 }
 
-void run_example_1() {
-    BPNode* root = NULL;
-    int test_values[] = {10, 20, 30, 40, 50, 60, 70, 80, 90};
-    int n = sizeof(test_values) / sizeof(test_values[0]);
-    
-    printf("\nExample 1: Basic B+ Tree Operations\n");
-    printf("Inserting values: 10, 20, 30, 40, 50, 60, 70, 80, 90\n");
-    
-    for(int i = 0; i < n; i++) {
-        bptree_insert(&bptree, test_values[i]);
-        printf("\nAfter inserting %d:\n", test_values[i]);
-        print_tree(bptree.root, 0);
-        printf("------------------------\n");
+// Zipfian ranks as in YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases"). zeta(n) is summed for the first
+// terms and integrated for the rest, which is close enough here and
+// takes no time at 100M keys.
+typedef struct Zipf {
+    long n;
+    double theta, alpha, zeta_n, eta;
+} Zipf;
+
+static double zipf_zeta(long n, double theta) {
+    const long EXACT = 1000;
+    double sum = 0;
+    for (long i = 1; i <= n && i <= EXACT; i++) {
+        sum += pow((double)i, -theta);
     }
-    
-    int search_keys[] = {30, 50, 90, 100};
-    for (int i = 0; i < 4; i++) {
-        search_and_print(&bptree, search_keys[i]);
+    if (n > EXACT) {
+        sum += (pow(n + 0.5, 1 - theta) - pow(EXACT + 0.5, 1 - theta)) / (1 - theta);
     }
+    return sum;
 }
 
-void run_example_2() {
-    
-    // Insert values in a pattern that allows for fuller nodes
-    // First batch: multiples of 3
-    for(int i = 3; i <= 99; i += 3) {
-        printf("inserting %d\n", i);
-        bptree_insert(&bptree, i);
-    }
-    
-    // Second batch: multiples of 3 plus 1
-    for(int i = 1; i <= 100; i += 3) {
-        bptree_insert(&bptree, i);
-    }
-    
-    // Final batch: multiples of 3 plus 2
-    for(int i = 2; i <= 98; i += 3) {
-        bptree_insert(&bptree, i);
-    }
-    
-    printf("\nTree after inserting values in non-sequential order:\n");
-    print_tree(bptree.root, 0);
+static Zipf zipf_init(long n, double theta) {
+    Zipf z = {n, theta, 1 / (1 - theta), zipf_zeta(n, theta), 0};
+    z.eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - (1 + pow(0.5, theta)) / z.zeta_n);
+    return z;
 }
 
-void run_example_3() {
-    printf("\nExample 3: Bulk Loading B+ Tree\n");
-    
-    // Create sorted array of values 1-100
-    int values[100];
-    for (int i = 0; i < 100; i++) {
-        values[i] = i + 1;
+static long zipf_next(const Zipf* z, uint64_t* state) {
+    double u = bench_uniform(state);
+    double uz = u * z->zeta_n;
+    if (uz < 1) {
+        return 0;
     }
-    
-    // Bulk load the tree
-    bptree_bulk_insert(&bptree, values, 100);
-    
-    printf("\nTree after bulk loading values 1-100:\n");
-    print_tree(bptree.root, 0);
-    
-    // Test some searches
-    int search_keys[] = {1, 50, 100, 101};
-    for (int i = 0; i < 4; i++) {
-        search_and_print(&bptree, search_keys[i]);
+    if (uz < 1 + pow(0.5, z->theta)) {
+        return 1;
     }
+    long rank = (long)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
 }
 
-void run_example_4() {
-    printf("\nExample 4: Sequential Insertion Limitation\n");
-    printf("This example shows why inserting sequential values one-by-one\n");
-    printf("leads to partially-filled nodes.\n\n");
-    
-    // Insert values 1-4 one at a time
-    for(int i = 1; i <= 4; i++) {
-        bptree_insert(&bptree, i);
-        printf("\nAfter inserting %d:\n", i);
-        print_tree(bptree.root, 0);
-        
-        if (i == 3) {
-            printf("Note: Leaf node is now full with [1 2 3]\n");
-        }
-        if (i == 4) {
-            printf("\nNote: When 4 is inserted, we must split:\n");
-            printf("- Left leaf gets [1 2]\n");
-            printf("- Right leaf gets [3 4]\n");
-            printf("- Parent gets [3]\n");
-            printf("\nThere's no way to get a third key into [1 2] because\n");
-            printf("any new key would be >= 3!\n");
+typedef struct BenchWorker {
+    pthread_t thread;
+    BPTree* bptree;
+    const BenchConfig* config;
+    pthread_barrier_t* start;
+    bpkey_t* keys;      // Drawn before the trial
+    uint8_t* ops;
+    uint32_t* latency;  // Nanoseconds per operation
+    bpkey_t* scan_out;
+    bpkey_t scan_hi;
+    long found;         // Stored, so the searches aren't optimized away
+} BenchWorker;
+
+static void bench_draw(BenchWorker* w, int thread, int trial, const Zipf* zipf) {
+    const BenchConfig* c = w->config;
+    uint64_t state = 0x5DEECE66DULL * (trial + 1000) + thread;
+    long next = c->keys / c->threads * thread;
+    for (long i = 0; i < c->ops; i++) {
+        int pick = (int)(bench_random(&state) % 100);
+        int op = pick < c->mix[OP_SEARCH] ? OP_SEARCH
+               : pick < c->mix[OP_SEARCH] + c->mix[OP_INSERT] ? OP_INSERT : OP_SCAN;
+        long index;
+        switch (c->dist) {
+        case DIST_SEQUENTIAL:
+            index = next++ % c->keys;
+            break;
+        case DIST_ZIPF:
+            // Scatter the ranks, so hot keys aren't all in one leaf.
+            index = (long)(((uint64_t)zipf_next(zipf, &state) * 0x9E3779B97F4A7C15ULL >> 16) %
+                           (uint64_t)c->keys);
+            break;
+        default:
+            index = (long)(bench_random(&state) % (uint64_t)c->keys);
+            break;
         }
-        printf("------------------------\n");
+        bool miss = op == OP_INSERT ||
+                    (c->dist == DIST_HIT_MISS && (int)(bench_random(&state) % 100) >= c->hit_percent);
+        w->keys[i] = key_from_long(2 * index + miss);
+        w->ops[i] = (uint8_t)op;
     }
 }
 
-void run_example_5() {
-    int test_values[] = {10, 20, 30, 25};
-    
-    printf("\nExample 5: Non-Sequential Insertion Pattern\n");
-    printf("Inserting values in order: 10, 20, 30, 25\n");
-    
-    for(int i = 0; i < 4; i++) {
-        bptree_insert(&bptree, test_values[i]);
-        printf("\nAfter inserting %d:\n", test_values[i]);
-        print_tree(bptree.root, 0);
-        printf("------------------------\n");
-    }
-    
-    // Test searches
-    printf("\nTesting searches:\n");
-    for (int i = 0; i < 4; i++) {
-        search_and_print(&bptree, test_values[i]);
-    }
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void run_example_10() {
-    int test_values[] = {10, 20, 30, 40, 50};
-    
-    printf("\nExample 10: Simple Sequential Insertion\n");
-    printf("Inserting values in order: 10, 20, 30, 40\n");
-    
-    for(int i = 0; i < 4; i++) {
-        bptree_insert(&bptree, test_values[i]);
+static void* bench_worker_run(void* arg) {
+    BenchWorker* w = (BenchWorker*)arg;
+    const BenchConfig* c = w->config;
+    BPTree* bptree = w->bptree;
+    long found = 0;
 
-        printf("\nAfter inserting %d:\n", test_values[i]);
-        print_tree(bptree.root, 0);
-        printf("------------------------\n");
+    pthread_barrier_wait(w->start);
+    uint64_t before = now_ns();
+    for (long i = 0; i < c->ops; i++) {
+        bpkey_t key = w->keys[i];
+        switch (w->ops[i]) {
+        case OP_SEARCH:
+            if (c->olc) {
+                found += bptree_search_olc(bptree, key, NULL);
+            } else {
+                found += bptree_search(bptree, key).node != NULL;
+            }
+            break;
+        case OP_INSERT:
+            if (c->olc) {
+                bptree_insert_olc(bptree, key, 0);
+            } else {
+                bptree_insert(bptree, key, 0);
+            }
+            break;
+        default:
+            found += bptree_scan(bptree, key, w->scan_hi, w->scan_out, NULL, c->scan_length);
+            break;
+        }
+        uint64_t after = now_ns();
+        w->latency[i] = after - before > UINT32_MAX ? UINT32_MAX : (uint32_t)(after - before);
+        before = after;
     }
+    w->found = found;
+    return NULL;
 }
 
-void run_example_11() {
-    int test_values[] = {10, 20, 30, 40, 25, 26, 29};
-    int n = sizeof(test_values) / sizeof(test_values[0]);
-    
-    printf("\nExample 11: Mixed Sequential and Non-Sequential Insertion\n");
-    printf("Inserting values: 10, 20, 30, 40, 25, 26, 29\n");
-    
-    for(int i = 0; i < n; i++) {
-        bptree_insert(&bptree, test_values[i]);
-        printf("\nAfter inserting %d:\n", test_values[i]);
-        print_tree(bptree.root, 0);
-        printf("------------------------\n");
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples.
+static uint32_t percentile(const uint32_t* sorted, long n, double p) {
+    long rank = (long)ceil(p * n);
+    return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+// One combination of the settings being compared.
+typedef struct BenchTree {
+    int order;
+    bool huge_pages;
+    int filter_bits;
+    bool leaf_models;
+    int top_levels;
+    int insert_buffers;
+} BenchTree;
+
+static void bench_order(BenchConfig* c, BenchTree s, const bpkey_t* loaded, const Zipf* zipf) {
+    BPTree tree;
+    bptree_init_order(&tree, s.order);
+    bptree_set_huge_pages(&tree, s.huge_pages);
+    bptree_set_filter(&tree, s.filter_bits);
+    bptree_set_leaf_models(&tree, s.leaf_models);
+    bptree_set_top_index(&tree, s.top_levels);
+    bptree_set_insert_buffers(&tree, s.insert_buffers);
+    PerfCounters perf;
+    perf_counters_open(&perf);
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, c->threads + 1);
+    BenchWorker* workers = (BenchWorker*)calloc(c->threads, sizeof(BenchWorker));
+    uint32_t* latency = (uint32_t*)malloc(sizeof(uint32_t) * c->ops * c->threads);
+    for (int t = 0; t < c->threads; t++) {
+        BenchWorker* w = &workers[t];
+        w->bptree = &tree;
+        w->config = c;
+        w->start = &start;
+        w->keys = (bpkey_t*)malloc(sizeof(bpkey_t) * c->ops);
+        w->ops = (uint8_t*)malloc(c->ops);
+        w->latency = latency + c->ops * t;
+        w->scan_out = (bpkey_t*)malloc(sizeof(bpkey_t) * c->scan_length);
+        w->scan_hi = key_from_long(2 * c->keys);
+    }
+
+    for (int trial = -c->warmup; trial < c->trials; trial++) {
+        // Inserts change the tree, so every trial starts from a fresh one.
+        if (trial == -c->warmup || c->mix[OP_INSERT] > 0) {
+            bptree_bulk_load(&tree, loaded, NULL, c->keys, 1.0, max_threads);
+        }
+        for (int t = 0; t < c->threads; t++) {
+            bench_draw(&workers[t], t, trial, zipf);
+        }
+        for (int t = 0; t < c->threads; t++) {
+            pthread_create(&workers[t].thread, NULL, bench_worker_run, &workers[t]);
+        }
+        pthread_barrier_wait(&start);
+        perf_counters_start(&perf);
+        double begin = wall_seconds();
+        for (int t = 0; t < c->threads; t++) {
+            pthread_join(workers[t].thread, NULL);
+        }
+        double seconds = wall_seconds() - begin;
+        perf_counters_stop(&perf);
+        if (trial < 0) {
+            continue;
+        }
+
+        long total = c->ops * c->threads;
+        qsort(latency, total, sizeof(uint32_t), compare_u32);
+        const char* pages = !s.huge_pages ? "small" : tree.arena.hugetlb_chunks > 0 ? "hugetlb" : "thp";
+        printf("%s,\"%s\",%d,%zu,%zu,%s,%d,%s,%d,%d,%ld,%s,%d,%d,%d,%d,%d,%s,%d,%ld,%.4f,%.3f,%u,%u,%u",
+               KEY_TYPE_NAME, tree.kernel_name, s.order,
+               node_children_offset(key_slots_for_order(s.order)), tree.arena.pools[LEAF].node_bytes,
+               pages, s.filter_bits, s.leaf_models ? "model" : "scan", s.top_levels, s.insert_buffers, c->keys,
+               c->dist_name, c->mix[OP_SEARCH], c->mix[OP_INSERT], c->mix[OP_SCAN], c->scan_length,
+               c->threads, c->olc ? "olc" : "plain", trial, total, seconds,
+               total / seconds / 1000000.0, percentile(latency, total, 0.50),
+               percentile(latency, total, 0.99), percentile(latency, total, 0.999));
+        // Counters per operation; empty where perf_event_open gave none.
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            if (perf.count[e] < 0) {
+                printf(",");
+            } else {
+                printf(",%.2f", perf.count[e] / total);
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    for (int t = 0; t < c->threads; t++) {
+        free(workers[t].keys);
+        free(workers[t].ops);
+        free(workers[t].scan_out);
     }
+    free(latency);
+    free(workers);
+    pthread_barrier_destroy(&start);
+    perf_counters_close(&perf);
+    bptree_destroy(&tree);
 }
 
-void run_example_12() {
-    int test_values[] = {10, 20, 30, 40, 25};
-    int n = sizeof(test_values) / sizeof(test_values[0]);
-    
-    printf("\nExample 12: Mixed Sequential and Non-Sequential Insertion\n");
-    printf("Inserting values: 10, 20, 30, 40, 25\n");
-    
-    for(int i = 0; i < n; i++) {
-        bptree_insert(&bptree, test_values[i]);
-        printf("\nAfter inserting %d:\n", test_values[i]);
-        print_tree(bptree.root, 0);
-        printf("------------------------\n");
+void print_bench_usage() {
+    printf("Usage: bptree bench [options], CSV on stdout\n");
+    printf("  -n <keys>         keys loaded: 0, 2, 4, ... (default 10000000)\n");
+    printf("  -d <distribution> keys operated on: seq, uniform, zipf[:theta] (default 0.99)\n");
+    printf("                    or hitmiss[:percent of hits] (default 50); default uniform\n");
+    printf("  -m <s:i:c>        percent of searches, inserts and scans (default 100:0:0)\n");
+    printf("  -l <length>       keys per scan (default 100)\n");
+    printf("  -t <threads>      worker threads (default 1); inserts from more\n");
+    printf("                    than one go through the OLC API, which has no scans\n");
+    printf("  -q <ops>          operations per thread per trial (default 1000000)\n");
+    printf("  -w <trials>       untimed warmup trials (default 1)\n");
+    printf("  -r <trials>       timed trials, one CSV row each (default 5)\n");
+    printf("  -o <orders>       comma-separated orders to compare (default %d)\n", ORDER);
+    printf("  -b <bytes>        comma-separated leaf sizes, as with -e\n");
+    printf("  -p <pages>        small, huge or small,huge: node page sizes to compare\n");
+    printf("                    (default small)\n");
+    printf("  -F <bits>         comma-separated key filter sizes in bits per key to\n");
+    printf("                    compare, 0 for none (default 0)\n");
+    printf("  -L <search>       scan, model or scan,model: leaf searches to compare,\n");
+    printf("                    whole leaves or around a leaf model's guess (default scan)\n");
+    printf("  -T <levels>       comma-separated top index depths to compare, 0 for\n");
+    printf("                    none (default 0)\n");
+    printf("  -B <messages>     comma-separated insert buffer sizes to compare, 0 for\n");
+    printf("                    none (default 0); not with the OLC API\n");
+}
+
+// Parse a comma-separated list of numbers of at least min into list.
+static bool bench_parse_list(const char* text, int min, int* list, int* count) {
+    char* copy = strdup(text);
+    bool ok = true;
+    for (char* item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        int value = atoi(item);
+        if (*count == BENCH_MAX_ORDERS || value < min) {
+            ok = false;
+            break;
+        }
+        list[(*count)++] = value;
     }
+    free(copy);
+    return ok;
 }
 
-int bptree_height(BPTree* bptree) {
-    if (bptree->root == NULL) return 0;
-    
-    int height = 1;
-    BPNode* node = bptree->root;
-    while (node->type != LEAF) {
-        height++;
-        node = node->children[0];  // Follow leftmost path
+// Parse a comma-separated list of first and/or second into chosen.
+static bool bench_parse_pair(const char* list, const char* first, const char* second,
+                             bool chosen[2]) {
+    char* copy = strdup(list);
+    bool ok = true;
+    for (char* item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (strcmp(item, first) == 0) {
+            chosen[0] = true;
+        } else if (strcmp(item, second) == 0) {
+            chosen[1] = true;
+        } else {
+            ok = false;
+        }
     }
-    return height;
+    free(copy);
+    return ok;
 }
 
-double bptree_avg_keys(BPTree* bptree) {
-    if (bptree->root == NULL) return 0;
-    
-    // Calculate max possible nodes for 100M elements
-    // At minimum 50% full, each leaf has ORDER keys
-    // So number of leaves ≈ N/ORDER
-    // Total nodes will be less than 2 * number of leaves
-    size_t max_nodes = (2 * 100000000) / ORDER + 1;
-    BPNode** queue = malloc(sizeof(BPNode*) * max_nodes);
-    if (queue == NULL) {
-        printf("Failed to allocate queue\n");
-        return 0;
+static bool bench_parse_distribution(BenchConfig* c, const char* name) {
+    c->dist_name = name;
+    const char* arg = strchr(name, ':');
+    size_t len = arg != NULL ? (size_t)(arg - name) : strlen(name);
+    if (len == 3 && strncmp(name, "seq", len) == 0) {
+        c->dist = DIST_SEQUENTIAL;
+    } else if (len == 7 && strncmp(name, "uniform", len) == 0) {
+        c->dist = DIST_UNIFORM;
+    } else if (len == 4 && strncmp(name, "zipf", len) == 0) {
+        c->dist = DIST_ZIPF;
+        if (arg != NULL) {
+            c->zipf_theta = atof(arg + 1);
+        }
+        return c->zipf_theta > 0 && c->zipf_theta < 1;
+    } else if (len == 7 && strncmp(name, "hitmiss", len) == 0) {
+        c->dist = DIST_HIT_MISS;
+        if (arg != NULL) {
+            c->hit_percent = atoi(arg + 1);
+        }
+        return c->hit_percent >= 0 && c->hit_percent <= 100;
+    } else {
+        return false;
     }
-    
-    int total_nodes = 0;
-    int total_keys = 0;
-    int front = 0, rear = 0;
-    queue[rear++] = bptree->root;
-    
-    while (front < rear) {
-        BPNode* node = queue[front++];
-        total_nodes++;
-        total_keys += node->nkeys;
-        
-        if (node->type != LEAF) {
-            for (int i = 0; i <= node->nkeys; i++) {
-                queue[rear++] = node->children[i];
+    return arg == NULL;
+}
+
+int bench_main(int argc, char* argv[]) {
+    BenchConfig c = {
+        .keys = 10000000, .dist_name = "uniform", .dist = DIST_UNIFORM, .zipf_theta = 0.99,
+        .hit_percent = 50, .mix = {100, 0, 0}, .scan_length = 100, .threads = 1,
+        .ops = 1000000, .warmup = 1, .trials = 5,
+    };
+    bool ok = argc % 2 == 0;
+    for (int i = 0; ok && i + 1 < argc; i += 2) {
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "-n") == 0) {
+            c.keys = atol(value);
+            ok = c.keys > 0 && c.keys <= 1000000000;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            ok = bench_parse_distribution(&c, value);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            ok = sscanf(value, "%d:%d:%d", &c.mix[OP_SEARCH], &c.mix[OP_INSERT], &c.mix[OP_SCAN]) == 3 &&
+                 c.mix[OP_SEARCH] >= 0 && c.mix[OP_INSERT] >= 0 && c.mix[OP_SCAN] >= 0 &&
+                 c.mix[OP_SEARCH] + c.mix[OP_INSERT] + c.mix[OP_SCAN] == 100;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            c.scan_length = atoi(value);
+            ok = c.scan_length > 0;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            c.threads = atoi(value);
+            ok = c.threads > 0;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            c.ops = atol(value);
+            ok = c.ops > 0;
+        } else if (strcmp(argv[i], "-w") == 0) {
+            c.warmup = atoi(value);
+            ok = c.warmup >= 0;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            c.trials = atoi(value);
+            ok = c.trials > 0;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            ok = bench_parse_list(value, 1, c.orders, &c.norders);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            int first = c.norders;
+            ok = bench_parse_list(value, 1, c.orders, &c.norders);
+            for (int j = first; j < c.norders; j++) {
+                c.orders[j] = order_for_leaf_bytes(c.orders[j]);
             }
+        } else if (strcmp(argv[i], "-F") == 0) {
+            ok = bench_parse_list(value, 0, c.filters, &c.nfilters);
+        } else if (strcmp(argv[i], "-T") == 0) {
+            ok = bench_parse_list(value, 0, c.top_levels, &c.ntop_levels);
+        } else if (strcmp(argv[i], "-B") == 0) {
+            ok = bench_parse_list(value, 0, c.buffers, &c.nbuffers);
+            for (int j = 0; j < c.nbuffers; j++) {
+                ok = ok && c.buffers[j] <= MAX_BUFFER_MESSAGES;
+            }
+        } else if (strcmp(argv[i], "-p") == 0) {
+            ok = bench_parse_pair(value, "small", "huge", c.pages);
+        } else if (strcmp(argv[i], "-L") == 0) {
+            ok = bench_parse_pair(value, "scan", "model", c.leaf_search);
+        } else {
+            ok = false;
         }
     }
-    
-    // double result = (double)total_keys / total_nodes;
-    double result = (double)total_keys / (total_nodes * ORDER);
-    free(queue);
-    return result;
-}
+    c.olc = c.threads > 1 && c.mix[OP_INSERT] > 0;
+    for (int j = 0; j < c.nbuffers; j++) {
+        ok = ok && (!c.olc || c.buffers[j] == 0);
+    }
+    if (!ok || (c.olc && c.mix[OP_SCAN] > 0)) {
+        print_bench_usage();
+        return 1;
+    }
+    if (c.norders == 0) {
+        c.orders[c.norders++] = ORDER;
+    }
+    if (!c.pages[0] && !c.pages[1]) {
+        c.pages[0] = true;
+    }
+    if (!c.leaf_search[0] && !c.leaf_search[1]) {
+        c.leaf_search[0] = true;
+    }
+    if (c.nfilters == 0) {
+        c.filters[c.nfilters++] = 0;
+    }
+    if (c.ntop_levels == 0) {
+        c.top_levels[c.ntop_levels++] = 0;
+    }
+    if (c.nbuffers == 0) {
+        c.buffers[c.nbuffers++] = 0;
+    }
 
-void example_100() {
-    const int N = 100000000;  // 100M elements
-    const int SEARCHES = 1000000;  // 1M searches
-    
-    printf("Order: %d\n", ORDER);
-    
-    int* values = (int*)malloc(sizeof(int) * N);
-    for (int i = 0; i < N; i++) {
-        values[i] = i;
+    bpkey_t* loaded = (bpkey_t*)malloc(sizeof(bpkey_t) * c.keys);
+    for (long i = 0; i < c.keys; i++) {
+        loaded[i] = key_from_long(2 * i);
     }
-    
-    clock_t start = clock();
-    bptree_bulk_insert(&bptree, values, N);
-    clock_t end = clock();
-    double bulk_time = ((double)(end - start)) / CLOCKS_PER_SEC;
-    
-    // Measure tree characteristics
-    int height = bptree_height(&bptree);
-    double avg_keys = bptree_avg_keys(&bptree);
-    printf("Tree height: %d\n", height);
-    printf("Average keys per node: %.2f\n", avg_keys);
-    
-    free(values);
-    
-    // Rest of the search benchmark code...
-    start = clock();
-    int found = 0;
-    for (int i = 0; i < SEARCHES; i++) {
-        int key = rand() % N;
-        Search result = bptree_search(&bptree, key);
-        if (result.node != NULL) {
-            found++;
+    Zipf zipf = c.dist == DIST_ZIPF ? zipf_init(c.keys, c.zipf_theta) : (Zipf){0};
+
+    printf("key_type,kernel,order,key_bytes,leaf_bytes,pages,filter_bits,leaf_search,top_levels,insert_buffers,keys,distribution,search_pct,insert_pct,"
+           "scan_pct,scan_length,threads,api,trial,ops,seconds,mops,p50_ns,p99_ns,p999_ns,cycles,"
+           "instructions,l1d_misses,llc_misses,dtlb_misses,branch_misses\n");
+    for (int i = 0; i < c.norders; i++) {
+        for (int huge = 0; huge < 2; huge++) {
+            for (int f = 0; f < c.nfilters && c.pages[huge]; f++) {
+                for (int model = 0; model < 2; model++) {
+                    for (int t = 0; t < c.ntop_levels && c.leaf_search[model]; t++) {
+                        for (int m = 0; m < c.nbuffers; m++) {
+                            BenchTree s = {c.orders[i], huge, c.filters[f], model,
+                                           c.top_levels[t], c.buffers[m]};
+                            bench_order(&c, s, loaded, &zipf);
+                        }
+                    }
+                }
+            }
         }
     }
-    end = clock();
-    
-    double search_time = ((double)(end - start)) / CLOCKS_PER_SEC;
-    double avg_search_time = (search_time * 1000000.0) / SEARCHES;
-    
-    printf("Average search time: %.2f microseconds\n", avg_search_time);
+
+    free(loaded);
+    return 0;
 }
 
 void print_usage() {
-    printf("Usage: bptree -e <example_number>\n");
+    printf("Usage: bptree -e <example_number> [-o <order> | -b <leaf_bytes>] [-t <threads>]\n");
+    printf("              [-f <tree_file>] [-p small|huge]\n");
+    printf("       bptree bench [options], see bptree bench -h\n");
+    printf("  -o sets the tree's order (default %d)\n", ORDER);
+    printf("  -b picks the largest order whose leaves fit in that many bytes;\n");
+    printf("     64, 128 and 256 have specialized search kernels\n");
+    printf("  -t caps the thread count for bulk loads and multi-threaded examples\n");
+    printf("  -f is where examples 108, 109 and 114 save their tree (default %s)\n", tree_file);
+    printf("  -p huge puts the nodes in 2 MiB pages\n");
     printf("Available examples:\n");
     printf("  1: Basic B+ Tree Operations (inserting 9 values)\n");
     printf("  2: Non-sequential Insertion Pattern\n");
     printf("  3: Bulk Loading (values 1-100)\n");
-    printf("  4: Sequential Insertion Limitation\n");
+    printf("  4: Sequential Insertion (1-9, appended to the rightmost leaf)\n");
     printf("  5: Inserting 10, 20, 30, 25\n");
+    printf("  6: Range Scan (values 1-100)\n");
+    printf("  7: Deletion with Borrowing and Merging\n");
     printf("  10: Simple Sequential Insertion (10, 20, 30, 40)\n");
     printf("  11: Mixed Sequential/Non-Sequential (10, 20, 30, 40, 25, 26, 29)\n");
     printf("  12: Mixed Sequential/Non-Sequential (10, 20, 30, 40, 25)\n");
     printf("  100: Bulk Loading and Random Searches\n");
+    printf("  101: Bulk Loading and Range Scans\n");
+    printf("  102: Tree Shape Under Mixed Insert/Delete Churn\n");
+    printf("  103: Trees With Different Node Sizes in One Process\n");
+    printf("  104: Batched Searches With Group Prefetching\n");
+    printf("  105: Concurrent Searches and Inserts (1-N threads)\n");
+    printf("  106: Parallel Bulk Load and Fill Factor\n");
+    printf("  107: Packed Leaves for Clustered Keys\n");
+    printf("  108: Saving a Tree and Searching It From a File Mapping\n");
+    printf("  109: Searching a Tree File Through a Buffer Pool\n");
+    printf("  110: Hardware and Software Counters per Operation\n");
+    printf("  111: Merging a Sorted Batch Into a Tree\n");
+    printf("  112: Tree Statistics After Bulk Load and Inserts\n");
+    printf("  113: Range-Partitioned Shards, One Thread Each\n");
+    printf("  114: Insert Buffers in Internal Nodes\n");
+    printf("  115: Snapshot Readers During Writes (Path Copying)\n");
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 3 || strcmp(argv[1], "-e") != 0) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return bench_main(argc - 2, argv + 2);
+    }
+    int example = -1;
+    int order = ORDER;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-e") == 0) {
+            example = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            order = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            order = order_for_leaf_bytes(atoi(argv[i + 1]));
+        } else if (strcmp(argv[i], "-t") == 0) {
+            max_threads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            tree_file = argv[i + 1];
+        } else if (strcmp(argv[i], "-p") == 0 && strcmp(argv[i + 1], "huge") == 0) {
+            huge_pages = true;
+        } else if (strcmp(argv[i], "-p") == 0 && strcmp(argv[i + 1], "small") == 0) {
+            huge_pages = false;
+        } else {
+            example = -1;
+            break;
+        }
+    }
+    if (example == -1 || argc % 2 != 1) {
         print_usage();
         return 1;
     }
     
-    bptree_init(&bptree);
-    
-    int example = atoi(argv[2]);
+    bptree_init_order(&bptree, order);
+    bptree_set_huge_pages(&bptree, huge_pages);
     
     switch(example) {
         case 1:
@@ -578,6 +6168,12 @@ int main(int argc, char* argv[]) {
         case 5:
             run_example_5();
             break;
+        case 6:
+            run_example_6();
+            break;
+        case 7:
+            run_example_7();
+            break;
         case 10:
             run_example_10();
             break;
@@ -590,11 +6186,57 @@ int main(int argc, char* argv[]) {
         case 100:
             example_100();
             break;
+        case 101:
+            example_101();
+            break;
+        case 102:
+            example_102();
+            break;
+        case 103:
+            example_103();
+            break;
+        case 104:
+            example_104();
+            break;
+        case 105:
+            example_105();
+            break;
+        case 106:
+            example_106();
+            break;
+        case 107:
+            example_107();
+            break;
+        case 108:
+            example_108();
+            break;
+        case 109:
+            example_109();
+            break;
+        case 110:
+            example_110();
+            break;
+        case 111:
+            example_111();
+            break;
+        case 112:
+            example_112();
+            break;
+        case 113:
+            example_113();
+            break;
+        case 114:
+            example_114();
+            break;
+        case 115:
+            example_115();
+            break;
         default:
             printf("Invalid example number: %d\n", example);
             print_usage();
             return 1;
     }
-    
+
+    bptree_destroy(&bptree);
     return 0;
 }
@@ -1,10 +1,5 @@
 #!/bin/bash
-
-for order in 2 3 10 15 60 100 120 240 500 1000; do
-    echo "Testing with ORDER = $order"
-    gcc -DORDER=$order bptree.c -o bptree
-    
-    ./bptree -e 100
-    
-    echo "----------------------------------------"
-done 
\ No newline at end of file
+# Usage: ./bptree_bench.sh [bench options] > results.csv
+# Options after the script name go to `bptree bench`, e.g. -d zipf -m 90:10:0
+gcc $CFLAGS -pthread bptree.c -o bptree -lm
+./bptree bench -o 2,3,10,15,60,100,120,240,500,1000 "$@"